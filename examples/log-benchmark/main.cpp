@@ -0,0 +1,101 @@
+/**
+ * Log throughput benchmark
+ *
+ * Logs as many messages as possible for a second to one, two and three loggers that discard
+ * their output, and prints the number of messages per second to the serial port. "uncached"
+ * formats the time stamp with eztime for every message, which is what Log did before it
+ * cached the time stamp; "cached" is Log itself. "deferred" is the number of DeferredLog calls per
+ * second: the cost in the caller, without the formatting, which happens later.
+ *
+ * The message is the one the pin watchers log on every change, with a string and two numbers.
+ *
+ * Needs no network and no file system: the clock is set to a fixed time
+ */
+
+#include <Application.h>
+
+// What PinWatcherComponent logs when a pin changes
+#define MESSAGE_FORMAT "[%s] Pin %d is now %d"
+
+// A destination that discards everything
+class NullPrint : public Print {
+  public:
+    size_t write(uint8_t) override { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { return size; }
+};
+
+NullPrint _null;
+Timezone _tz;
+std::vector<Logger *> _loggers;
+
+// Log the way Log did before caching: format the time stamp with eztime for every message
+void logUncached(Log::LOGLEVEL level, const char *format, ...) {
+  char buffer[MAX_LOGMESSAGE_SIZE + 1];
+  char *p = stpcpy(buffer, _tz.dateTime(LOG_DEFAULT_TIME_FORMAT).c_str());
+  p = stpcpy(p, "INF: ");
+  va_list args;
+  va_start(args, format);
+  vsnprintf(p, sizeof(buffer) - (p - buffer), format, args);
+  va_end(args);
+  for (auto logger: _loggers)
+    logger->println(level, buffer);
+}
+
+// The number of messages logged in one second
+template<typename F> unsigned long messagesPerSecond(F logOne) {
+  unsigned long count = 0;
+  unsigned long start = millis();
+  while (millis() - start < 1000) {
+    logOne(count);
+    count++;
+    // Keep the watchdog happy
+    if ((count & 0xFF) == 0)
+      yield();
+  }
+  return count;
+}
+
+// The number of DeferredLog calls per second, not counting the time spent formatting them afterwards
+unsigned long deferredPerSecond() {
+  unsigned long count = 0;
+  unsigned long spentUs = 0;
+  while (spentUs < 1000000) {
+    unsigned long start = micros();
+    for (int i = 0; i < 32; i++)
+      DeferredLog::logInformation(MESSAGE_FORMAT, "DigitalPin", 5, (int)((count + i) & 1));
+    spentUs += micros() - start;
+    count += 32;
+    DeferredLog::process();
+    yield();
+  }
+  return (unsigned long)((uint64_t)count * 1000000 / spentUs);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  // Only log to the loggers below
+  Log::setSerialLogLevel(Log::LOGLEVEL::None);
+  // A fixed time and time zone, so time stamps are formatted as usual
+  _tz.setPosix("CET-1CEST,M3.5.0,M10.5.0/3");
+  UTC.setTime(1700000000);
+  Clock::synchronize(1700000000LL * 1000000LL, Clock::micros64());
+  Log::setTimezone(&_tz);
+  DeferredLog::begin(4096);
+
+  Serial.println("loggers\tuncached/s\tcached/s\tdeferred/s");
+  for (int loggers = 1; loggers <= 3; loggers++) {
+    Logger *logger = new Logger("null", Log::LOGLEVEL::Information, &_null);
+    _loggers.push_back(logger);
+    Log::addLogger(logger);
+
+    unsigned long uncached = messagesPerSecond([](unsigned long i) { logUncached(Log::LOGLEVEL::Information, MESSAGE_FORMAT, "DigitalPin", 5, (int)(i & 1)); });
+    unsigned long cached = messagesPerSecond([](unsigned long i) { Log::logInformation(MESSAGE_FORMAT, "DigitalPin", 5, (int)(i & 1)); });
+    unsigned long deferred = deferredPerSecond();
+    Serial.printf("%d\t%lu\t\t%lu\t\t%lu\n", loggers, uncached, cached, deferred);
+  }
+}
+
+void loop() {
+}
@@ -0,0 +1,62 @@
+/**
+ * Log file benchmark
+ *
+ * Writes the same messages to a FileLogger on LittleFS, once writing every message right away
+ * (buffer size 0) and once collecting them in a page-sized buffer, and prints messages and
+ * kilobytes per second, and the number of file writes and flushes to flash per 100 messages,
+ * to the serial port. Fewer, page-sized writes mean less time spent and less flash wear.
+ *
+ * Needs a LittleFS file system, but no network. The files are removed afterwards
+ */
+
+#include <Application.h>
+
+#define MESSAGE_COUNT 500
+
+void removeFiles(const char *path, int fileCount) {
+  LittleFS.remove(path);
+  for (int n = 1; n < fileCount; n++)
+    LittleFS.remove(String(path) + "." + String(n));
+}
+
+void run(const char *name, size_t bufferSize) {
+  const char *path = "/log/benchmark.log";
+  removeFiles(path, 4);
+  FileLogger logger(&LittleFS, path, Log::LOGLEVEL::Information, 65536, 4, bufferSize, 10000);
+
+  char message[80];
+  unsigned long start = millis();
+  for (int i = 0; i < MESSAGE_COUNT; i++) {
+    snprintf(message, sizeof(message), "2024-01-01 12:00:00 INF: Benchmark message number %d", i);
+    logger.println(Log::LOGLEVEL::Information, message);
+    // Keep the watchdog happy
+    yield();
+  }
+  logger.flush();
+  unsigned long elapsedMs = millis() - start;
+  if (elapsedMs == 0)
+    elapsedMs = 1;
+
+  // Each message is the text plus "\r\n"
+  unsigned long bytes = (unsigned long)MESSAGE_COUNT * (strlen(message) + 2);
+  Serial.printf("%s\t%lu\t\t%lu\t%lu\t\t%lu\n", name,
+    (unsigned long)MESSAGE_COUNT * 1000 / elapsedMs, bytes / elapsedMs, logger.writes() * 100 / MESSAGE_COUNT, logger.syncs() * 100 / MESSAGE_COUNT);
+  removeFiles(path, 4);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  if (!LittleFS.begin()) {
+    Serial.println("No LittleFS file system");
+    return;
+  }
+
+  Serial.println("buffer\tmessages/s\tKB/s\twrites/100\tsyncs/100");
+  run("none", 0);
+  run("page", FILE_LOG_PAGE_SIZE);
+}
+
+void loop() {
+}
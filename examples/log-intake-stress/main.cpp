@@ -0,0 +1,144 @@
+/**
+ * Log intake stress test
+ *
+ * Log calls from other tasks and from interrupts are handed to the loop task through a lock-free
+ * queue (see IntakeQueue.h). This sketch hammers that queue and checks that nothing gets lost
+ * or mangled on the way:
+ *
+ * - On ESP32, two tasks on the other core each log 20000 numbered messages with a checksum
+ * - On ESP8266, which has no other tasks, a timer interrupt calls Log::logFromISR() every 100 us
+ *   for five seconds
+ *
+ * Meanwhile loop() hands the queued messages to a logger that counts them. A full queue drops
+ * messages, which is fine, but every message must arrive or be counted as dropped, arrive whole
+ * and, per task, in order. The result goes to the serial port.
+ *
+ * The queue itself has been run on a PC with four producer and two consumer threads; the ESP32
+ * path of this sketch has not been run on a device yet
+ *
+ * Needs no network and no file system
+ */
+
+#include <Application.h>
+#include <atomic>
+
+#if defined(ESP32)
+  #define PRODUCER_COUNT 2
+  #define MESSAGES_PER_PRODUCER 20000
+#else
+  #define TIMER_INTERVAL_US 100
+  #define TIMER_DURATION_MS 5000
+#endif
+
+// What the logger saw
+unsigned long _received = 0;
+unsigned long _mangled = 0;
+unsigned long _outOfOrder = 0;
+bool _isReported = false;
+
+#if defined(ESP32)
+std::atomic<int> _producersDone(0);
+long _lastNumber[PRODUCER_COUNT];
+
+// The checksum of message [number] from producer [id]
+unsigned long checksum(int id, unsigned long number) {
+  return (number + 1) * 2654435761UL ^ (unsigned long)id;
+}
+
+// Log numbered messages as fast as possible, giving up the CPU now and then
+void producer(void *parameter) {
+  int id = (int)(intptr_t)parameter;
+  for (unsigned long number = 0; number < MESSAGES_PER_PRODUCER; number++) {
+    Log::logInformation("stress %d %lu %lu", id, number, checksum(id, number));
+    if ((number & 0x3F) == 0)
+      vTaskDelay(1);
+  }
+  _producersDone++;
+  vTaskDelete(NULL);
+}
+
+// Messages look like "<time stamp> INF: stress <id> <number> <checksum>"
+void onMessage(const char *message) {
+  _received++;
+  const char *text = strstr(message, "stress ");
+  int id;
+  unsigned long number, sum;
+  if (text == NULL || sscanf(text, "stress %d %lu %lu", &id, &number, &sum) != 3 || id < 0 || id >= PRODUCER_COUNT || sum != checksum(id, number)) {
+    _mangled++;
+    return;
+  }
+  if ((long)number <= _lastNumber[id])
+    _outOfOrder++;
+  _lastNumber[id] = number;
+}
+
+bool isDone() { return _producersDone.load() == PRODUCER_COUNT; }
+unsigned long sent() { return (unsigned long)PRODUCER_COUNT * MESSAGES_PER_PRODUCER; }
+
+void start() {
+  for (int id = 0; id < PRODUCER_COUNT; id++) {
+    _lastNumber[id] = -1;
+    // On the core loop() doesn't run on, so they really run at the same time
+    xTaskCreatePinnedToCore(producer, "producer", 4096, (void *)(intptr_t)id, 1, NULL, 1 - xPortGetCoreID());
+  }
+}
+#else
+volatile unsigned long _fired = 0;
+unsigned long _startTime;
+
+void IRAM_ATTR onTimer() {
+  _fired++;
+  Log::logFromISR(Log::LOGLEVEL::Information, "stress from interrupt");
+}
+
+// The interrupt logs its text as is, after the time stamp and level
+void onMessage(const char *message) {
+  _received++;
+  const char *text = strstr(message, "INF: ");
+  if (text == NULL || strcmp(text + 5, "stress from interrupt") != 0)
+    _mangled++;
+}
+
+bool isDone() {
+  if (millis() - _startTime < TIMER_DURATION_MS)
+    return false;
+  timer1_disable();
+  return true;
+}
+unsigned long sent() { return _fired; }
+
+void start() {
+  _startTime = millis();
+  timer1_attachInterrupt(onTimer);
+  // 80 MHz / 16 = 5 ticks per microsecond
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+  timer1_write(TIMER_INTERVAL_US * 5);
+}
+#endif
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  // Without an Application, say which task is the loop task ourselves
+  LoopTask::capture();
+  Log::setSerialLogLevel(Log::LOGLEVEL::None);
+  Log::addLogger(new Logger("stress", Log::LOGLEVEL::Information, onMessage));
+
+  Serial.println("Stress testing the log intake queue...");
+  start();
+}
+
+void loop() {
+  Log::loop();
+  if (_isReported || !isDone())
+    return;
+
+  // Whatever is still queued
+  Log::loop();
+  _isReported = true;
+  unsigned long dropped = Log::intakeDropped();
+  bool isOk = _received + dropped == sent() && _mangled == 0 && _outOfOrder == 0;
+  Serial.printf("Sent %lu, received %lu, dropped %lu, mangled %lu, out of order %lu\n", sent(), _received, dropped, _mangled, _outOfOrder);
+  Serial.println(isOk ? "OK" : "FAILED");
+}
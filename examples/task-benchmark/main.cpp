@@ -0,0 +1,71 @@
+/**
+ * Task scheduler benchmark
+ *
+ * Adds 1, 10, 100 and 1000 tasks that are not due (they run once, then every hour) and prints
+ * how long a call to Tasks::loop() takes with that many tasks, in microseconds, to the serial
+ * port. Tasks are kept in a schedule ordered by their next run time, so this should stay flat
+ * as the number of tasks grows. "scan" is what looking at every task costs, for comparison:
+ * that is what Tasks::loop() did before.
+ *
+ * Only as many tasks as TASKS_MAX_COUNT (16 by default) can be added, and the Tasks component
+ * reserves room for all of them. Add e.g. -D TASKS_MAX_COUNT=1000 to build_flags in
+ * platformio.ini to go up to 1000 on an ESP32; an ESP8266 has room for about 200.
+ *
+ * Needs no network and no file system
+ */
+
+#include <Application.h>
+
+#define LOOP_COUNT 10000
+
+// The time of a single call of [f] in microseconds, averaged over LOOP_COUNT calls
+template<typename F> float microsecondsPerCall(F f) {
+  unsigned long start = micros();
+  for (int i = 0; i < LOOP_COUNT; i++) {
+    f();
+    // Keep the watchdog happy
+    if ((i & 0xFF) == 0)
+      yield();
+  }
+  return (float)(micros() - start) / LOOP_COUNT;
+}
+
+void run(int taskCount) {
+  // Too large for the stack, and maybe for static memory
+  Tasks *tasks = new Tasks();
+  for (int i = 0; i < taskCount; i++)
+    tasks->add("benchmark", 3600000, []() {});
+  // Every task runs once, as soon as possible
+  tasks->loop();
+
+  float heap = microsecondsPerCall([tasks]() { tasks->loop(); });
+  int due = 0;
+  float scan = microsecondsPerCall([tasks, &due]() {
+    tasks->forEach([&due](Task *task) {
+      if (task->nextRunTime().hasPassed())
+        due++;
+    });
+  });
+
+  Serial.printf("%d\t%.2f\t\t%.2f\n", taskCount, heap, scan);
+  delete tasks;
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  // Only errors, e.g. when there's no room for a task
+  Log::setSerialLogLevel(Log::LOGLEVEL::Error);
+
+  Serial.println("tasks\tloop (us)\tscan (us)");
+  // Stop at TASKS_MAX_COUNT
+  for (int taskCount = 1; taskCount <= 1000; taskCount *= 10) {
+    run(taskCount < TASKS_MAX_COUNT ? taskCount : TASKS_MAX_COUNT);
+    if (taskCount >= TASKS_MAX_COUNT)
+      break;
+  }
+}
+
+void loop() {
+}
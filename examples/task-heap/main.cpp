@@ -0,0 +1,81 @@
+/**
+ * Task heap check
+ *
+ * Tasks are kept in a fixed pool and their functions are stored inside the task, so adding,
+ * running, cancelling and re-adding tasks should never touch the heap. This sketch churns
+ * tasks for 10000 loops: a few repeating tasks, timeouts that are added as others expire,
+ * coroutines that come and go and tasks that are cancelled right after they're added. It prints
+ * the free heap and the largest free block before and after to the serial port; they should
+ * be the same.
+ *
+ * Needs no network and no file system
+ */
+
+#include <Application.h>
+
+#define LOOP_COUNT 10000
+
+Tasks _tasks;
+unsigned long _runs = 0;
+
+uint32_t largestFreeBlock() {
+#if defined(ESP8266)
+  return ESP.getMaxFreeBlockSize();
+#else
+  return ESP.getMaxAllocHeap();
+#endif
+}
+
+// One loop's worth of churn
+void churn(int i) {
+  // A timeout every loop, which expires a few loops later
+  _tasks.addTimeout("timeout", i % 5, []() { _runs++; });
+  // A task that never runs
+  _tasks.cancel(_tasks.add("cancelled", 1000, []() { _runs++; }));
+  // Now and then a coroutine that takes a few loops
+  if (i % 10 == 0) {
+    int steps = 0;
+    _tasks.addCoroutine("coroutine", [steps](Task &task) mutable {
+      TASK_BEGIN(task);
+      while (steps < 3) {
+        steps++;
+        _runs++;
+        TASK_YIELD(task);
+      }
+      TASK_END(task);
+    });
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  // Logging formats messages, which may allocate
+  Log::setSerialLogLevel(Log::LOGLEVEL::None);
+
+  // Tasks that stay
+  _tasks.add("fast", 0, []() { _runs++; });
+  _tasks.add("rate", 2, []() { _runs++; }, FixedRate);
+  // Fill the pool once, so the first use of any slot is out of the way
+  churn(0);
+  _tasks.loop();
+
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = largestFreeBlock();
+  for (int i = 1; i <= LOOP_COUNT; i++) {
+    churn(i);
+    _tasks.loop();
+    delay(1);
+  }
+  uint32_t freeHeapAfter = ESP.getFreeHeap();
+  uint32_t largestBlockAfter = largestFreeBlock();
+
+  Serial.printf("%lu task runs in %d loops, %u tasks left\n", _runs, LOOP_COUNT, (unsigned)_tasks.count());
+  Serial.printf("Free heap: %u before, %u after\n", freeHeap, freeHeapAfter);
+  Serial.printf("Largest free block: %u before, %u after\n", largestBlock, largestBlockAfter);
+  Serial.println(freeHeap == freeHeapAfter && largestBlock == largestBlockAfter ? "OK: no heap use" : "FAILED: the heap changed");
+}
+
+void loop() {
+}
@@ -27,7 +27,7 @@ Application::Application(const char *title, const char *version, uint16_t otaPor
   _macAddress(WiFi.macAddress()),
   _bootTimeUtc(0),
   _bootTimeLocal(0),
-  _restartTimeMs((unsigned long)-1)
+  _isRestartScheduled(false)
 {
   // Set the singleton application object
   this->_app = this;
@@ -70,8 +70,37 @@ const char *Application::config(const char *key, const char *defaultValue) {
  * Setup the application. Must be called after construction!
  */
 void Application::setup() {
+  // Only this task may use the library directly: others hand logging and publishing to it
+  LoopTask::capture();
   Log::logDebug("[Application] Starting setup...");
 
+  // Profile component loops from the start (if configured), can be switched at runtime
+  Components::setProfiling(atoi(this->config("profiling", "0")) != 0);
+
+  // Buffer serial log output (off by default), so logging doesn't wait for the serial port
+  Log::setSerialBuffer(atoi(this->config("log-serial-buffer", "0")));
+
+  // Deferred logging (off by default): DeferredLog calls are formatted later, from a component
+  int deferredLogSize = atoi(this->config("log-deferred", "0"));
+  if (deferredLogSize > 0)
+    Components::add(new DeferredLogComponent(deferredLogSize));
+
+  // Log to rotating files (off by default), e.g. log-file=/log/app.log. Other file systems work too, by prefix
+  String logFile(this->config("log-file"));
+  if (!logFile.isEmpty()) {
+    FS *logFs;
+    String logPath;
+    this->getFileSystemForPath(logFile, &logFs, &logPath);
+    Log::addLogger(new FileLogger(
+      logFs, logPath.c_str(),
+      Log::parseLogLevel(this->config("log-file-level", "Warning"), Log::LOGLEVEL::Warning),
+      atoi(this->config("log-file-size", "65536")),
+      atoi(this->config("log-file-count", "4")),
+      FILE_LOG_PAGE_SIZE,
+      Duration::parse(this->config("log-file-flush", "10")) * 1000
+    ));
+  }
+
   // Station SSID
   String ssid(this->config("wifi-ssid"));
 
@@ -80,7 +109,7 @@ void Application::setup() {
   if (!ap_ssid.isEmpty())
     ap_ssid.replace(F("#HOSTNAME#"), this->hostname());
 
-  Components::add(this->_wifi = new WifiComponent(
+  this->_wifi = new WifiComponent(
     _hostname, 
     // STA: Connect to this SSID
     ssid.c_str(), this->config("wifi-password"), 
@@ -90,7 +119,22 @@ void Application::setup() {
     // Soft AP
     ap_ssid.c_str(), this->config("wifi-ap-password"),
     atoi(this->config("wifi-ap-permanent", "0")) != 0 // Permanent soft AP
-  ));
+  );
+  // More networks: wifi-ssid-2/wifi-password-2 and up
+  for (int n = 2; n <= WIFI_MAX_NETWORKS; n++) {
+    const char *otherSsid = this->config(("wifi-ssid-" + String(n)).c_str());
+    if (*otherSsid != 0)
+      this->_wifi->addNetwork(otherSsid, this->config(("wifi-password-" + String(n)).c_str()));
+  }
+  // Roaming to a stronger access point, off by default
+  this->_wifi->setRoaming(
+    atoi(this->config("wifi-roam-threshold", "0")),
+    atoi(this->config("wifi-roam-hysteresis", "8")),
+    Duration::parse(this->config("wifi-roam-interval", "10")) * 1000
+  );
+  // Boot: try the last good connection before scanning
+  this->_wifi->setFastConnect(atoi(this->config("wifi-fast-connect", "1")) != 0, atoi(this->config("wifi-reuse-ip", "0")) != 0);
+  Components::add(this->_wifi);
 
   if (ssid.isEmpty()) {
     Log::logWarning("[Application] Skipping time component because no SSID configured");
@@ -98,7 +142,10 @@ void Application::setup() {
     // Set up the time component with a default timeout
     Components::add(this->_time = new TimeComponent(
       this->config("timezone", "Europe/Amsterdam"),
-      Duration::parse(this->config("time-timeout", "5"))
+      Duration::parse(this->config("time-timeout", "5")),
+      this->config("ntp-server", "pool.ntp.org"),
+      Duration::parse(this->config("ntp-interval", "30m")),
+      this->config("timezone-posix")
     ));
   }
 
@@ -124,7 +171,7 @@ void Application::setBootTimeIfAvailable() {
   if (this->_bootTimeUtc == 0 && timeStatus() == timeSet) {
     this->_bootTimeUtc = UTC.tzTime();
     this->_bootTimeLocal = this->_time->TZ()->tzTime();
-    Log::logDebug("[Application] Booted at %s UTC", this->bootTimeUtcString().c_str());
+    LOG_DEBUG("[Application] Booted at %s UTC", this->bootTimeUtcString().c_str());
   }  
 }
 
@@ -138,27 +185,48 @@ void Application::loop() {
   }
 
   Components::loop();
+  // Write buffered log output
+  Log::loop();
 
-  if (this->_restartTimeMs != (unsigned long)-1 && millis() > this->_restartTimeMs) {
+  if (this->_isRestartScheduled && this->_restartTime.hasPassed()) {
     // Log::logWarning("[Application] Restart requested in %ld ms", this->_restartDelay);
     Log::logInformation("[Application] Restarting.");
     this->webserver()->stop();
+    // Write out buffered log messages, e.g. to the log file
+    Log::flush();
     ESP.restart();
   }
 }
 
 /**
- * Add a component
+ * Yield until [deadline], the next component or task deadline or a scheduled restart, whichever is first.
+ * Components that are awake want every loop, but get one at least every APPLICATION_IDLE_SLICE_MS
  */
-void Application::addComponent(Component *component) {
-  Components::add(component);
+void Application::idleUntil(Deadline deadline) {
+  Deadline wakeTime = Components::nextWakeTime();
+  if (deadline.isBefore(wakeTime))
+    wakeTime = deadline;
+  if (Components::isAnyAwake()) {
+    Deadline sliceEnd = Deadline::in(APPLICATION_IDLE_SLICE_MS);
+    if (sliceEnd.isBefore(wakeTime))
+      wakeTime = sliceEnd;
+  }
+  if (this->_isRestartScheduled && this->_restartTime.isBefore(wakeTime))
+    wakeTime = this->_restartTime;
+
+  // delay() lets the WiFi stack run and the CPU idle. Always yield at least once
+  Milliseconds remaining = wakeTime.remaining(Clock::millis64());
+  if (remaining > 0)
+    delay(remaining);
+  else
+    yield();
 }
 
 /**
- * Add a periodic task, i.e. a callback
+ * Add a component
  */
-void Application::addTask(String name, Milliseconds interval, std::function<void()> const taskFunction) {
-  this->_tasks->add(name, interval, taskFunction);
+void Application::addComponent(Component *component) {
+  Components::add(component);
 }
 
 void Application::mapGet(const char *path, std::function<void(WEBSERVER *)> const handler) {
@@ -760,6 +828,8 @@ void Application::enableInfoPage(const char *path, std::function<void (String &)
       // \r\nClientIP: " + this->wifi()->wifiClient()->localIP().toString() +
       F("\r\nRSSI: ") + String(WiFi.RSSI()) + F(" dBm") +
       F("\r\nBSSID: ") +  WiFi.BSSIDstr() +
+      F("\r\nWiFi: ") + this->wifi()->statistics() +
+      F("\r\nWiFi states: ") + this->wifi()->stateTimes() +
       F("\r\nMAC: ") + WiFi.macAddress() +
       F("\r\nCPU: ") + this->chipModelName() +
       F("\r\nFlash: ") + String(ESP.getFlashChipSize() / 1024) + "K" +
@@ -777,6 +847,8 @@ void Application::enableInfoPage(const char *path, std::function<void (String &)
       otherFileSystemInfo +
 #endif
       F("\r\nBootUTC: ") + this->bootTimeUtcString() +
+      F("\r\nClock: ") + Clock::statistics() +
+      (DeferredLog::isDeferring() ? F("\r\nDeferred log: ") + DeferredLog::statistics() : String()) +
       F("\r\nUTC: ") + UTC.dateTime("Y-m-d H:i:s") + 
       F("\r\nLocal time: ") + this->time()->TZ()->dateTime("Y-m-d H:i:s") + 
       F("\r\nUptime: ") + this->formatDuration(d)
@@ -789,6 +861,98 @@ void Application::enableInfoPage(const char *path, std::function<void (String &)
   });  
 }
 
+void Application::enableTasksPage(const char *path) {
+  this->mapGet(path, [this](WEBSERVER *server) {
+    String response =
+      String(F("Tasks: ")) + String(this->_tasks->count()) + F(" of ") + String(TASKS_MAX_COUNT) +
+      F("\r\nSlice budget: ") + String(this->_tasks->sliceBudget()) + F(" us") +
+      F("\r\nTimes in us, lateness in ms") +
+#if TASK_HISTOGRAMS
+      F("\r\n\r\nInterval\tRuns\tMean\tMin\tMax\tP50\tP99\tLate\tMaxLate\tP99Late\tOverruns\tSkipped\tName");
+#else
+      F("\r\n\r\nInterval\tRuns\tMean\tMin\tMax\tLate\tMaxLate\tOverruns\tSkipped\tName");
+#endif
+
+    this->_tasks->forEach([&response](Task *task) {
+      unsigned long maxRunTime = task->maxRunTimeUs();
+      response +=
+        String(F("\r\n")) + String(task->interval()) +
+        "\t" + String(task->runCount()) +
+        "\t" + String(task->meanRunTimeUs()) +
+        "\t" + String(task->minRunTimeUs()) +
+        "\t" + String(maxRunTime) +
+#if TASK_HISTOGRAMS
+        "\t" + String(task->runTimeHistogram().percentile(50, maxRunTime)) +
+        "\t" + String(task->runTimeHistogram().percentile(99, maxRunTime)) +
+#endif
+        "\t" + String(task->lastLateness()) +
+        "\t" + String(task->maxLateness()) +
+#if TASK_HISTOGRAMS
+        "\t" + String(task->latenessHistogram().percentile(99, task->maxLateness())) +
+#endif
+        "\t" + String(task->sliceOverruns()) +
+        "\t" + String(task->skippedRuns()) +
+        "\t" + task->name() + (task->isPaused() ? F(" (paused)") : F(""));
+    });
+
+    server->send(200, F("text/plain"), response.c_str());
+  });
+}
+
+void Application::enableComponentsPage(const char *path) {
+  this->mapGet(path, [](WEBSERVER *server) {
+    auto profiling = server->arg(F("profiling"));
+    if (profiling == "on" || profiling == "1")
+      Components::setProfiling(true);
+    else if (profiling == "off" || profiling == "0")
+      Components::setProfiling(false);
+    if (server->arg(F("reset")) == "1")
+      Components::resetProfiles();
+
+    // A profile as values in microseconds
+    auto format = [](const LoopProfile *profile, const char *separator, std::function<String(const char *, const String &)> const &field) {
+      return
+        field("count", String(profile->count())) + separator +
+        field("mean", String(ProfileClock::microseconds(profile->meanTicks()), 1)) + separator +
+        field("min", String(ProfileClock::microseconds(profile->minTicks()), 1)) + separator +
+        field("max", String(ProfileClock::microseconds(profile->maxTicks()), 1)) + separator +
+        field("p50", String(ProfileClock::microseconds(profile->percentileTicks(50)), 1)) + separator +
+        field("p99", String(ProfileClock::microseconds(profile->percentileTicks(99)), 1));
+    };
+
+    if (server->arg(F("format")) == "json") {
+      auto jsonField = [](const char *key, const String &value) { return String("\"") + key + "\":" + value; };
+      String response = String(F("{\"profiling\":")) + (Components::isProfiling() ? "true" : "false");
+      if (Components::isProfiling()) {
+        response += String(F(",\"loop\":{")) + format(Components::profile(), ",", jsonField) + F("},\"components\":[");
+        bool isFirst = true;
+        for (auto component: Components::all()) {
+          response += String(isFirst ? "" : ",") + F("{\"name\":\"") + component->name() + F("\",\"asleep\":") + (component->isAsleep() ? "true" : "false") + "," + format(component->profile(), ",", jsonField) + "}";
+          isFirst = false;
+        }
+        response += "]";
+      }
+      response += "}";
+      server->send(200, F("application/json"), response.c_str());
+      return;
+    }
+
+    if (!Components::isProfiling()) {
+      server->send(200, F("text/plain"), F("Profiling is off, use ?profiling=on to switch it on"));
+      return;
+    }
+
+    auto textField = [](const char *, const String &value) { return value; };
+    String response =
+      String(F("Times in us\r\n\r\nCount\tMean\tMin\tMax\tP50\tP99\tComponent")) +
+      F("\r\n") + format(Components::profile(), "\t", textField) + F("\t(loop)");
+    for (auto component: Components::all())
+      response += String(F("\r\n")) + format(component->profile(), "\t", textField) + "\t" + component->name() + (component->isAsleep() ? F(" (asleep)") : F(""));
+
+    server->send(200, F("text/plain"), response.c_str());
+  });
+}
+
 void Application::addOledDisplay(int sda, int scl, uint8_t address) {
   this->addComponent(this->_oled = new OledComponent(sda, scl, address));
   auto display = _oled->getDisplay();
@@ -817,15 +981,16 @@ void Application::addU8Display(U8X8 *display) {
 
 void Application::scheduleRestart(unsigned long delayMs) {
   Log::logWarning("[Application] Scheduling restart in %lu ms", delayMs);
-  _restartTimeMs = millis() + delayMs;
+  this->_restartTime = Deadline::in(delayMs);
+  this->_isRestartScheduled = true;
 }
 
 unsigned long Application::timeOperation(std::function<void()> func, const char *message) {
-  auto start_time = millis();
+  auto start_time = micros();
   func();
-  auto duration = millis() - start_time;
+  unsigned long duration = micros() - start_time;
   if (message != NULL) {
-    Log::logDebug("[Application] %s: %lu ms", message, duration);
+    Log::logDebug("[Application] %s: %lu.%03lu ms", message, duration / 1000, duration % 1000);
   }
-  return duration;
+  return duration / 1000;
 }
\ No newline at end of file
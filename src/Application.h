@@ -18,9 +18,17 @@
 #include "U8DisplayComponent.h"
 #include "OtaComponent.h"
 #include "RotaryEncoderWatcherComponent.h"
+#include "DeferredLogComponent.h"
+#include "FileLogger.h"
 
 #include <functional>
 
+// The longest idleUntil() waits while a component is awake (e.g. MQTT, OTA or the web server),
+// so they are still serviced often enough
+#ifndef APPLICATION_IDLE_SLICE_MS
+  #define APPLICATION_IDLE_SLICE_MS 10
+#endif
+
 class Application {
   protected:
     // Application title and version
@@ -40,7 +48,9 @@ class Application {
     const String _macAddress;
     time_t _bootTimeUtc;
     time_t _bootTimeLocal;
-    unsigned long _restartTimeMs;
+    // When to restart, if scheduled
+    bool _isRestartScheduled;
+    Deadline _restartTime;
 
     String makeHtml(const char *file, const char *message);
     String HtmlEncode(const char *s);
@@ -77,8 +87,15 @@ class Application {
 
     // Components/tasks
     void addComponent(Component *component);
-    void addTask(String name, Milliseconds interval, std::function<void()> const taskFunction);
-
+    template<typename F> TaskHandle addTask(const char *name, Milliseconds interval, F taskFunction, TaskMode mode = FixedDelay, uint8_t maxBurst = TASK_MAX_BURST) { return this->_tasks->add(name, interval, taskFunction, mode, maxBurst); }
+    template<typename F> TaskHandle addTimeout(const char *name, Milliseconds timeout, F taskFunction) { return this->_tasks->addTimeout(name, timeout, taskFunction); }
+    template<typename F> TaskHandle addCoroutine(const char *name, F coroutineFunction) { return this->_tasks->addCoroutine(name, coroutineFunction); }
+    // Task names are copied, so they may come from a String as well
+    template<typename F> TaskHandle addTask(const String &name, Milliseconds interval, F taskFunction, TaskMode mode = FixedDelay, uint8_t maxBurst = TASK_MAX_BURST) { return this->_tasks->add(name, interval, taskFunction, mode, maxBurst); }
+    template<typename F> TaskHandle addTimeout(const String &name, Milliseconds timeout, F taskFunction) { return this->_tasks->addTimeout(name, timeout, taskFunction); }
+    template<typename F> TaskHandle addCoroutine(const String &name, F coroutineFunction) { return this->_tasks->addCoroutine(name, coroutineFunction); }
+
+    Tasks *tasks() { return this->_tasks; }
     WifiComponent *wifi() { return this->_wifi; }
     TimeComponent *time() { return this->_time; }
     WEBSERVER *webserver() { return this->_ota->webserver(); }
@@ -93,6 +110,11 @@ class Application {
     virtual void setup();
     virtual void loop();
 
+    // Call after loop() to give up the CPU until [deadline], or until a sleeping component or
+    // a task is due, whichever comes first. While a component is awake, this waits at most
+    // APPLICATION_IDLE_SLICE_MS, so it is never starved
+    void idleUntil(Deadline deadline);
+
     // Informational
     const char *hostname() { return this->_hostname; }
     const String &title() { return this->_title; }
@@ -120,6 +142,11 @@ class Application {
     void enableFileEditor(const char *readPath = "/read", const char *writePath = "/write", const char *editPath = "/edit", const char *dirPath = "/dir", const char *deletePath = "/delete", const char *mkdirPath = "/mkdir", const char *rmdirPath = "/rmdir", const char *uploadPath = "/upload");
 
     void enableInfoPage(const char *path, std::function<void (String &)> const &postProcessInfo = NULL);
+    // Show run time and lateness statistics of all tasks
+    void enableTasksPage(const char *path = "/tasks");
+    // Show loop time profiles of all components as text, or JSON with ?format=json.
+    // ?profiling=on|off switches profiling, ?reset=1 clears the profiles
+    void enableComponentsPage(const char *path = "/components");
 
     // The name of the config file. Can be overriden BEFORE constructing the Application
     static const char *configFileName;
@@ -0,0 +1,43 @@
+#include "Clock.h"
+
+int64_t Clock::_syncUtc = 0;
+Microseconds Clock::_syncMonotonic = 0;
+int32_t Clock::_driftPpb = 0;
+int64_t Clock::_lastOffsetUs = 0;
+unsigned long Clock::_syncs = 0;
+
+// The wall clock from the last synchronization, corrected for the drift since
+int64_t Clock::utcMicros()
+{
+  if (_syncs == 0)
+    return 0;
+  int64_t elapsed = (int64_t)(micros64() - _syncMonotonic);
+  return _syncUtc + elapsed + elapsed * _driftPpb / 1000000000LL;
+}
+
+// The difference between the wall clock and the new time, divided by the time since the last
+// synchronization, is how much the drift was off. Only learn from intervals long enough for the
+// network delay not to matter
+void Clock::synchronize(int64_t utc, Microseconds at)
+{
+  if (_syncs > 0) {
+    int64_t elapsed = (int64_t)(at - _syncMonotonic);
+    int64_t predicted = _syncUtc + elapsed + elapsed * _driftPpb / 1000000000LL;
+    _lastOffsetUs = utc - predicted;
+    // Big jumps are the time being set, not drift
+    if (elapsed >= 60000000LL && _lastOffsetUs > -1000000LL && _lastOffsetUs < 1000000LL) {
+      int64_t drift = _driftPpb + _lastOffsetUs * 1000000000LL / elapsed;
+      _driftPpb = (int32_t)(drift > CLOCK_MAX_DRIFT_PPB ? CLOCK_MAX_DRIFT_PPB : drift < -CLOCK_MAX_DRIFT_PPB ? -CLOCK_MAX_DRIFT_PPB : drift);
+    }
+  }
+  _syncUtc = utc;
+  _syncMonotonic = at;
+  _syncs++;
+}
+
+String Clock::statistics()
+{
+  char buffer[80];
+  snprintf(buffer, sizeof(buffer), "syncs=%lu;offset=%ld;drift=%.3f;", _syncs, (long)_lastOffsetUs, driftPpm());
+  return String(buffer);
+}
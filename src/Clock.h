@@ -0,0 +1,63 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <Arduino.h>
+#include <time.h>
+#if defined(ESP32)
+  #include <esp_timer.h>
+#endif
+
+// Microseconds, and a point in time in milliseconds since boot. Both are 64 bits, so they don't wrap around
+typedef uint64_t Microseconds;
+typedef uint64_t Timestamp;
+
+// The largest drift Clock corrects for, in parts per billion (500 ppm; crystals do better than 100)
+#ifndef CLOCK_MAX_DRIFT_PPB
+  #define CLOCK_MAX_DRIFT_PPB 500000
+#endif
+
+/***
+ * The time: a monotonic clock since boot and a wall clock (UTC).
+ *
+ * The monotonic clock has 64 bits, so unlike millis() and micros() it does not wrap around.
+ * The wall clock runs on the monotonic clock from the last synchronization (e.g. with NTP),
+ * corrected for the drift measured between synchronizations
+ */
+class Clock {
+  private:
+    // The UTC time (us since 1970) at the last synchronization, and the monotonic time it happened
+    static int64_t _syncUtc;
+    static Microseconds _syncMonotonic;
+    // The drift of the monotonic clock (ppb, positive if it runs slow), the wall clock's error at
+    // the last synchronization (us, positive if it was behind) and the number of synchronizations
+    static int32_t _driftPpb;
+    static int64_t _lastOffsetUs;
+    static unsigned long _syncs;
+
+  public:
+    // The monotonic clock
+    static Microseconds micros64() {
+#if defined(ESP32)
+      return (Microseconds)esp_timer_get_time();
+#else
+      return ::micros64();
+#endif
+    }
+    static Timestamp millis64() { return micros64() / 1000; }
+
+    // Set the wall clock: it was [utc] (us since 1970) at monotonic time [at]
+    static void synchronize(int64_t utc, Microseconds at);
+    static bool isSynchronized() { return _syncs > 0; }
+
+    // The wall clock in us, ms or seconds since 1970. 0 if not synchronized
+    static int64_t utcMicros();
+    static int64_t utcMillis() { return utcMicros() / 1000; }
+    static time_t utcSeconds() { return (time_t)(utcMicros() / 1000000); }
+
+    static unsigned long syncs() { return _syncs; }
+    static int64_t lastOffsetUs() { return _lastOffsetUs; }
+    static float driftPpm() { return _driftPpb / 1000.0f; }
+    // The above as "key=value;" pairs
+    static String statistics();
+};
+#endif
@@ -2,11 +2,42 @@
 #include "logging.h"
 
 // Create a component with a name
-Component::Component(const char *name) : _name(name) {}
+Component::Component(const char *name) :
+  _name(name),
+  _isAsleep(false),
+  _hasWakeTime(false),
+  _wakeTime(0),
+  _profile(NULL),
+  _isReady(true),
+  _isSetUp(false),
+  _provides(0),
+  _needs(0)
+{}
 
 // Get the name of a component
 const char *Component::name() { return this->_name.c_str(); }
 
+// Signal that the component is (no longer) ready
+void Component::setReady(bool isReady) {
+  if (isReady == this->_isReady)
+    return;
+  this->_isReady = isReady;
+  Log::logDebug("[%s] %s", this->name(), isReady ? "Ready" : "Not ready");
+  // Components::loop() takes care of the components that depend on this one
+  Components::isReadinessChanged = true;
+}
+
+// Should loop() be called? Sleeping components wake up when their wake time has passed
+bool Component::isDue(Timestamp now) {
+  if (!this->_isAsleep)
+    return true;
+  if (this->_hasWakeTime && this->_wakeTime.hasPassed(now)) {
+    this->_isAsleep = false;
+    return true;
+  }
+  return false;
+}
+
 void Component::setStatus(int statusCode, Log::LOGLEVEL level, const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -31,22 +62,138 @@ void Component::setStatus(int statusCode) {
 
 // The "global" list of components
 std::vector<Component *> Components::components;
+// Capabilities of the components that are ready
+uint16_t Components::availableCapabilities = 0;
+bool Components::isReadinessChanged = false;
+// Profile of the whole loop, only while profiling
+LoopProfile *Components::loopProfile = NULL;
 // The global status handler to allow components to report stuff during setup()
 void (*Components::status)(const char*name, int statusCode, Log::LOGLEVEL, const char *message) = NULL;
 
-// Add a component to the list and return it
+// Add a component to the list and return it. Set it up, unless it needs capabilities that are not available yet
 Component *Components::add(Component *component)
 {
     Log::logDebug("[Components] Adding component '%s'", component->name());
     Components::components.push_back(component);
+    if (Components::isProfiling() && component->_profile == NULL)
+      component->_profile = new LoopProfile();
+    if (Components::isAvailable(component->_needs))
+      Components::setUp(component);
+    else
+      Log::logDebug("[Components] Component '%s' waits for capabilities 0x%04x", component->name(), component->_needs & ~Components::availableCapabilities);
+    return component;
+}
+
+// Call setup() on a component. It may be ready right away, and provide capabilities
+void Components::setUp(Component *component)
+{
     Log::logTrace("[Components] Calling setup() on component '%s'", component->name());
+    component->_isSetUp = true;
     component->setup();
-    return component;
+    Components::isReadinessChanged = true;
 }
 
-// Call each component's setup() method
+// Determine which capabilities are available. Set up the components waiting for them, and
+// notify components that need capabilities that became available or were lost
+void Components::updateReadiness()
+{
+  Components::isReadinessChanged = false;
+
+  uint16_t available = 0;
+  for (auto component: components)
+    if (component->isReady())
+      available |= component->_provides;
+
+  uint16_t gained = available & ~Components::availableCapabilities;
+  uint16_t lost = Components::availableCapabilities & ~available;
+  Components::availableCapabilities = available;
+  if (gained == 0 && lost == 0)
+    return;
+
+  Log::logDebug("[Components] Capabilities are now 0x%04x (gained 0x%04x, lost 0x%04x)", available, gained, lost);
+  // By index: setup() may add components
+  for (size_t i = 0; i < components.size(); i++) {
+    Component *component = components[i];
+    if (!component->_isSetUp) {
+      if (Components::isAvailable(component->_needs))
+        Components::setUp(component);
+    } else {
+      if (component->_needs & lost)
+        component->onCapabilityLost(component->_needs & lost);
+      if (component->_needs & gained)
+        component->onCapabilityReady(component->_needs & gained);
+    }
+  }
+}
+
+// Call the loop() method of each component that is due
 void Components::loop()
 {
+  if (Components::isReadinessChanged)
+    Components::updateReadiness();
+
+  Timestamp now = Clock::millis64();
+  if (Components::loopProfile == NULL) {
+    for (auto component: components)
+      if (component->_isSetUp && component->isDue(now))
+        component->loop();
+    return;
+  }
+
+  // Same as above, but timing each component and the loop as a whole. A component's loop()
+  // can turn profiling off (e.g. from a web request), so check for profiles after each one
+  uint32_t loopStart = ProfileClock::ticks();
+  for (auto component: components)
+    if (component->_isSetUp && component->isDue(now)) {
+      uint32_t start = ProfileClock::ticks();
+      component->loop();
+      uint32_t ticks = ProfileClock::ticks() - start;
+      if (component->_profile != NULL)
+        component->_profile->add(ticks);
+    }
+  if (Components::loopProfile != NULL)
+    Components::loopProfile->add(ProfileClock::ticks() - loopStart);
+}
+
+// Turn profiling on (allocating profiles) or off (freeing them)
+void Components::setProfiling(bool isEnabled)
+{
+  if (isEnabled == Components::isProfiling())
+    return;
+
+  Log::logInformation("[Components] Profiling %s", isEnabled ? "on" : "off");
+  for (auto component: components) {
+    delete component->_profile;
+    component->_profile = isEnabled ? new LoopProfile() : NULL;
+  }
+  delete Components::loopProfile;
+  Components::loopProfile = isEnabled ? new LoopProfile() : NULL;
+}
+
+// Clear the profiles of all components and the loop
+void Components::resetProfiles()
+{
+  if (!Components::isProfiling())
+    return;
+  for (auto component: components)
+    component->_profile->clear();
+  Components::loopProfile->clear();
+}
+
+bool Components::isAnyAwake()
+{
+  for (auto component: components)
+    if (component->_isSetUp && !component->_isAsleep)
+      return true;
+  return false;
+}
+
+// The earliest wake time of all sleeping components
+Deadline Components::nextWakeTime()
+{
+  Deadline earliest = Deadline::in(Deadline::MaxDelay);
   for (auto component: components)
-    component->loop();
+    if (component->_isAsleep && component->_hasWakeTime && component->_wakeTime.isBefore(earliest))
+      earliest = component->_wakeTime;
+  return earliest;
 }
\ No newline at end of file
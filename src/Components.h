@@ -3,14 +3,58 @@
 
 #include <Arduino.h>
 #include "logging.h"
+#include "Deadline.h"
+#include "Profiling.h"
 #include <vector>
 
+/***
+ * Things components provide to each other when they are ready, as bit flags. A component
+ * that needs a capability is set up when (at least) one component that provides it is ready
+ */
+enum Capability : uint16_t {
+  // A network connection, e.g. WiFi
+  NetworkCapability = 0x0001,
+  // The current date and time
+  TimeCapability = 0x0002,
+  // Applications can define their own capabilities, starting at this one
+  UserCapability = 0x0100
+};
+
 /***
  * Base class for a component that has a name, plus setup() and loop() functions
+ *
+ * By default, loop() is called on every iteration of the main loop. A component that
+ * has nothing to do until some time in the future can sleep until then, so Components::loop()
+ * skips it. Sleeping ends when the time comes or when wake() is called; from then on,
+ * loop() is called on every iteration again until the component goes back to sleep
+ *
+ * setup() should return quickly. Components that need time to start up (e.g. to connect)
+ * do that step by step from loop(), and call setReady() when they are done
+ *
+ * A component can declare the capabilities it provides when it is ready, and those it
+ * needs. setup() is only called once all capabilities it needs are available; after that
+ * it is notified when they are lost and when they become available again
  */
 class Component {
   private:
     String _name;
+    // Is the component asleep, and if so, until when (unless indefinitely)?
+    bool _isAsleep;
+    bool _hasWakeTime;
+    Deadline _wakeTime;
+    // The time loop() takes. Only allocated while profiling is on
+    LoopProfile *_profile;
+    // Has the component finished starting up, e.g. connected to its network?
+    bool _isReady;
+    // Has setup() been called? It waits for the capabilities the component needs
+    bool _isSetUp;
+    // Capabilities (bit flags) provided when ready, and needed before setup()
+    uint16_t _provides;
+    uint16_t _needs;
+
+  protected:
+    // Components that start up in the background (from loop()) report progress here
+    void setReady(bool isReady);
 
   public:
     Component(const char *name);
@@ -20,9 +64,42 @@ class Component {
     virtual void setup() = 0;
     virtual void loop() = 0;
 
+    // Don't call loop() until [deadline]
+    void sleepUntil(Deadline deadline) { this->_isAsleep = true; this->_hasWakeTime = true; this->_wakeTime = deadline; }
+    // Don't call loop() for [ms] milliseconds
+    void sleepFor(Milliseconds ms) { this->sleepUntil(Deadline::in(ms)); }
+    // Don't call loop() until wake() is called
+    void sleep() { this->_isAsleep = true; this->_hasWakeTime = false; }
+    // Call loop() on every iteration again
+    void wake() { this->_isAsleep = false; }
+
+    bool isAsleep() { return this->_isAsleep; }
+    // Is the component up and running? Components are ready after setup() unless they say otherwise
+    bool isReady() { return this->_isSetUp && this->_isReady; }
+    bool isSetUp() { return this->_isSetUp; }
+
+    // Declare the capabilities this component provides when it is ready, or needs before it
+    // is set up. Call these before the component is added, e.g. from its constructor
+    void provides(uint16_t capabilities) { this->_provides |= capabilities; }
+    void needs(uint16_t capabilities) { this->_needs |= capabilities; }
+    uint16_t provided() { return this->_provides; }
+    uint16_t needed() { return this->_needs; }
+
+    // Called after setup() when capabilities this component needs become available again,
+    // or are lost. [capabilities] holds the ones that changed
+    virtual void onCapabilityReady(uint16_t capabilities) {}
+    virtual void onCapabilityLost(uint16_t capabilities) {}
+    // Should loop() be called at [now]? Wakes the component when its wake time has passed
+    bool isDue(Timestamp now);
+
+    // The time loop() takes, NULL when profiling is off. See Components::setProfiling()
+    const LoopProfile *profile() { return this->_profile; }
+
     // Supplied by Components
      void setStatus(int statusCode, Log::LOGLEVEL level, const char *format, ...);
      void setStatus(int statucCode);
+
+    friend class Components;
 };
 
 /***
@@ -36,18 +113,51 @@ class Component {
  * 
  *  In loop():
  *    Components::loop();
+ *
+ * Components that need capabilities (e.g. a network) are set up when other components
+ * that provide them are ready, so the order in which they are added does not matter
  */
 class Components {
   private:
     // The list of components
     static std::vector<Component *> components;
+    // Profile of Components::loop() as a whole, NULL when profiling is off
+    static LoopProfile *loopProfile;
     static void (*status)(const char *componentName, int statusCode, Log::LOGLEVEL, const char *message);
+    // The capabilities provided by components that are ready
+    static uint16_t availableCapabilities;
+    // Has a component become (not) ready since the last loop()?
+    static bool isReadinessChanged;
+
+    static void setUp(Component *component);
+    static void updateReadiness();
 
   public:
-    // Add a component and return it
+    // Add a component and return it. It is set up as soon as the capabilities it needs are available
     static Component *add(Component *component);
-    // Call loop() on all components
+    // Set up components that were waiting for capabilities, notify components of capabilities
+    // that became available or were lost, then call loop() on all components that are not asleep
     static void loop();
+    // Are all [capabilities] provided by components that are ready?
+    static bool isAvailable(uint16_t capabilities) { return (Components::availableCapabilities & capabilities) == capabilities; }
+    // Is any component that is set up awake, i.e. does it want loop() on every iteration?
+    static bool isAnyAwake();
+    // The earliest time a sleeping component wakes up. Without any, this is Deadline::MaxDelay ms from now
+    static Deadline nextWakeTime();
+    // The time the next component is due: now if one is awake, or else the next wake time
+    static Deadline nextDeadline() { return Components::isAnyAwake() ? Deadline::now() : Components::nextWakeTime(); }
+
+    // All components, in the order they were added
+    static const std::vector<Component *> &all() { return Components::components; }
+
+    // Turn timing of loop() per component on or off. Profiles use memory and are cleared when
+    // profiling is turned off; without profiling, loop() has no timing overhead
+    static void setProfiling(bool isEnabled);
+    static bool isProfiling() { return Components::loopProfile != NULL; }
+    // Clear all profiles
+    static void resetProfiles();
+    // Profile of Components::loop() as a whole, NULL when profiling is off
+    static const LoopProfile *profile() { return Components::loopProfile; }
 
     // Status function, handy during startup (but can be used anywhere)
     static void setStatusHandler(void (*handler)(const char *componentName, int statusCode, Log::LOGLEVEL, const char *message)) { Components::status = handler; }
@@ -0,0 +1,48 @@
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <Arduino.h>
+#include <limits.h>
+#include "Clock.h"
+
+typedef unsigned long Milliseconds;
+
+/**
+ * A point in time in milliseconds since boot, as returned by Clock::millis64().
+ *
+ * The clock has 64 bits, so deadlines keep comparing correctly after millis() wraps around
+ * at 49.7 days.
+ */
+struct Deadline {
+  Timestamp time;
+
+  // The furthest from now a deadline is meant to be, e.g. for "no deadline"
+  static const Milliseconds MaxDelay = LONG_MAX;
+
+  // Constructor with a time in milliseconds since boot
+  Deadline(Timestamp time = 0) : time(time) {}
+
+  // Now, and a deadline [ms] milliseconds from now
+  static Deadline now() { return Deadline(Clock::millis64()); }
+  static Deadline in(Milliseconds ms) { return Deadline(Clock::millis64() + ms); }
+
+  // The number of milliseconds the deadline has passed at [now]. Negative if it hasn't passed yet
+  long elapsed(Timestamp now) const {
+    int64_t elapsed = (int64_t)(now - this->time);
+    return elapsed > LONG_MAX ? LONG_MAX : elapsed < LONG_MIN ? LONG_MIN : (long)elapsed;
+  }
+  long elapsed() const { return this->elapsed(Clock::millis64()); }
+  // Has the deadline passed at [now]? A deadline passes at the time itself
+  bool hasPassed(Timestamp now) const { return now >= this->time; }
+  bool hasPassed() const { return this->hasPassed(Clock::millis64()); }
+  // The number of milliseconds until the deadline passes, 0 if it has passed already
+  Milliseconds remaining(Timestamp now) const { return this->hasPassed(now) ? 0 : (this->time - now > ULONG_MAX ? ULONG_MAX : (Milliseconds)(this->time - now)); }
+
+  // Is this deadline earlier than another one?
+  bool isBefore(const Deadline &other) const { return this->time < other.time; }
+
+  Deadline operator+(Milliseconds ms) const { return Deadline(this->time + ms); }
+  bool operator==(const Deadline &other) const { return this->time == other.time; }
+  bool operator!=(const Deadline &other) const { return this->time != other.time; }
+};
+#endif
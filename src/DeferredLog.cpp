@@ -0,0 +1,184 @@
+#include "DeferredLog.h"
+#include "Clock.h"
+
+RingBuffer *DeferredLog::_buffer = NULL;
+uint32_t DeferredLog::_captured = 0;
+uint32_t DeferredLog::_processed = 0;
+
+void DeferredLog::begin(size_t size)
+{
+  if (_buffer == NULL)
+    _buffer = new RingBuffer(size, RingBuffer::DropOldest);
+}
+
+// A record starts with the level, the time and the address of the format
+void DeferredLog::capture(Log::LOGLEVEL level, const char *format, Writer &writer)
+{
+  uint8_t lvl = level;
+  int64_t utcMs = Log::currentUtcMs();
+  writer.write(&lvl, sizeof(lvl));
+  writer.write(&utcMs, sizeof(utcMs));
+  writer.write(&format, sizeof(format));
+}
+
+int DeferredLog::process(unsigned long budgetUs)
+{
+  if (_buffer == NULL)
+    return 0;
+
+  Microseconds startTime = Clock::micros64();
+  uint8_t record[DEFERRED_LOG_MAX_RECORD + 1];
+  int count = 0;
+  int size;
+  while ((size = _buffer->pop((char *)record, sizeof(record))) >= 0) {
+    format(record, size);
+    _processed++;
+    count++;
+    if (budgetUs > 0 && Clock::micros64() - startTime >= budgetUs)
+      break;
+  }
+  return count;
+}
+
+// Walk the format and print each conversion with its own argument. A conversion without a
+// (matching) argument prints as "?", where printf() would crash, and integers are converted to
+// the length the conversion asks for, so a wrong "l" or "ll" doesn't pass the wrong size
+void DeferredLog::format(const uint8_t *record, size_t size)
+{
+  const uint8_t *p = record;
+  const uint8_t *end = record + size;
+  uint8_t level;
+  int64_t utcMs;
+  const char *format;
+  if (size < sizeof(level) + sizeof(utcMs) + sizeof(format))
+    return;
+  memcpy(&level, p, sizeof(level)); p += sizeof(level);
+  memcpy(&utcMs, p, sizeof(utcMs)); p += sizeof(utcMs);
+  memcpy(&format, p, sizeof(format)); p += sizeof(format);
+
+  char message[MAX_LOGMESSAGE_SIZE + 1];
+  char *out = message + Log::formatPrefix(message, sizeof(message), (Log::LOGLEVEL)level, utcMs);
+  char *outEnd = message + sizeof(message) - 1;
+
+  const char *f = format;
+  while (*f != 0 && out < outEnd) {
+    if (*f != '%') {
+      *out++ = *f++;
+      continue;
+    }
+    if (f[1] == '%') {
+      *out++ = '%';
+      f += 2;
+      continue;
+    }
+
+    // The conversion: flags, width, precision, length and type. A "*" width or precision is an int argument.
+    // The length is kept apart: the argument is passed as the type the record says it is, not the one the format asks for
+    char spec[24];
+    char lengthModifier[3] = "";
+    size_t n = 0;
+    size_t m = 0;
+    bool isMissingStar = false;
+    spec[n++] = *f++;
+    while (*f != 0 && strchr("-+ #0123456789.*hlLqjzt", *f) != NULL && n < sizeof(spec) - 4) {
+      if (*f == '*' && !(p + 1 + sizeof(int) <= end && *p == IntArgument)) {
+        // Never pass a "*" on to snprintf(): it would read an int that isn't there
+        isMissingStar = true;
+        f++;
+      } else if (*f == '*') {
+        int value;
+        memcpy(&value, p + 1, sizeof(value));
+        p += 1 + sizeof(value);
+        n += snprintf(spec + n, sizeof(spec) - n - 3, "%d", value);
+        if (n > sizeof(spec) - 4)
+          n = sizeof(spec) - 4;
+        f++;
+      } else if (strchr("hlLqjzt", *f) != NULL) {
+        if (m < sizeof(lengthModifier) - 1)
+          lengthModifier[m++] = *f;
+        lengthModifier[m] = 0;
+        f++;
+      } else
+        spec[n++] = *f++;
+    }
+    char conversion = *f;
+    if (conversion == 0)
+      break;
+    f++;
+    if (isMissingStar) {
+      *out++ = '?';
+      continue;
+    }
+
+    // The argument, if it's there and fits the conversion
+    ArgumentType type = p < end ? (ArgumentType)*p : (ArgumentType)0xFF;
+    bool isInteger = type == IntArgument || type == LongArgument || type == LongLongArgument;
+    bool matches =
+      (strchr("diouxXc", conversion) != NULL && isInteger) ||
+      (strchr("eEfFgGaA", conversion) != NULL && type == DoubleArgument) ||
+      (conversion == 'p' && type == PointerArgument) ||
+      (conversion == 's' && type == StringArgument);
+    if (!matches) {
+      *out++ = '?';
+      continue;
+    }
+
+    p++;
+    size_t room = outEnd - out + 1;
+    int length = 0;
+    if (isInteger) {
+      long long value;
+      if (type == IntArgument) { int v; memcpy(&v, p, sizeof(v)); p += sizeof(v); value = v; }
+      else if (type == LongArgument) { long v; memcpy(&v, p, sizeof(v)); p += sizeof(v); value = v; }
+      else { memcpy(&value, p, sizeof(value)); p += sizeof(value); }
+
+      // Convert the value to the size the format asks for: "%lld" with an int, or "%d" with a long long, is fine
+      if (conversion == 'c' || m == 0 || lengthModifier[0] == 'h') {
+        if (conversion != 'c')
+          n += strlcpy(spec + n, lengthModifier, sizeof(spec) - n - 1);
+        spec[n++] = conversion;
+        spec[n] = 0;
+        length = snprintf(out, room, spec, (int)value);
+      } else if (strcmp(lengthModifier, "l") == 0) {
+        spec[n++] = 'l';
+        spec[n++] = conversion;
+        spec[n] = 0;
+        length = snprintf(out, room, spec, (long)value);
+      } else {
+        spec[n++] = 'l';
+        spec[n++] = 'l';
+        spec[n++] = conversion;
+        spec[n] = 0;
+        length = snprintf(out, room, spec, value);
+      }
+    } else {
+      // Doubles, pointers and (narrow) strings are passed as they are, whatever the length says
+      spec[n++] = conversion;
+      spec[n] = 0;
+      switch (type) {
+        case DoubleArgument: { double value; memcpy(&value, p, sizeof(value)); p += sizeof(value); length = snprintf(out, room, spec, value); break; }
+        case PointerArgument: { const void *value; memcpy(&value, p, sizeof(value)); p += sizeof(value); length = snprintf(out, room, spec, value); break; }
+        case StringArgument: {
+          const char *value = (const char *)p;
+          size_t stringLength = strnlen(value, end - p);
+          p += stringLength + 1;
+          length = snprintf(out, room, spec, value);
+          break;
+        }
+        default: break;
+      }
+    }
+    out += length < 0 ? 0 : ((size_t)length >= room ? room - 1 : (size_t)length);
+  }
+  *out = 0;
+
+  Log::dispatch((Log::LOGLEVEL)level, message);
+}
+
+String DeferredLog::statistics()
+{
+  char buffer[80];
+  snprintf(buffer, sizeof(buffer), "captured=%lu;processed=%lu;dropped=%lu;",
+    (unsigned long)_captured, (unsigned long)_processed, (unsigned long)(_buffer == NULL ? 0 : _buffer->dropped()));
+  return String(buffer);
+}
@@ -0,0 +1,133 @@
+#ifndef __DEFERRED_LOG_H__
+#define __DEFERRED_LOG_H__
+
+#include <Arduino.h>
+#include "Logging.h"
+#include "RingBuffer.h"
+
+// The maximum size of a captured message: level, time, format and arguments. Longer string arguments are cut off
+#ifndef DEFERRED_LOG_MAX_RECORD
+  #define DEFERRED_LOG_MAX_RECORD 160
+#endif
+
+/***
+ * Deferred logging: log calls capture the level, the time, the format and the arguments in a ring
+ * buffer, and the messages are formatted and sent to the loggers later, from DeferredLogComponent.
+ *
+ * Capturing copies a few bytes per argument and costs a fraction of formatting, so this is for
+ * code that must return quickly, e.g. pin watchers and MQTT callbacks. The format must be a string
+ * literal (only its address is captured); string arguments are copied. Until begin() is called,
+ * and outside the loop task, messages are logged right away
+ */
+class DeferredLog {
+  private:
+    // The types of captured arguments, as they are passed to printf() after promotion
+    enum ArgumentType : uint8_t { IntArgument, LongArgument, LongLongArgument, DoubleArgument, PointerArgument, StringArgument };
+
+    // Writes a record
+    struct Writer {
+      uint8_t *p;
+      uint8_t *end;
+
+      void write(const void *data, size_t size) {
+        if (this->p + size > this->end)
+          size = this->end - this->p;
+        memcpy(this->p, data, size);
+        this->p += size;
+      }
+      template<typename T> void put(ArgumentType type, T value) {
+        // Only whole arguments: one that doesn't fit is left out
+        if (this->p + 1 + sizeof(value) > this->end)
+          return;
+        this->write(&type, 1);
+        this->write(&value, sizeof(value));
+      }
+
+      void add(int value) { this->put(IntArgument, value); }
+      void add(unsigned int value) { this->put(IntArgument, value); }
+      void add(long value) { this->put(LongArgument, value); }
+      void add(unsigned long value) { this->put(LongArgument, value); }
+      void add(long long value) { this->put(LongLongArgument, value); }
+      void add(unsigned long long value) { this->put(LongLongArgument, value); }
+      void add(double value) { this->put(DoubleArgument, value); }
+      void add(const void *value) { this->put(PointerArgument, value); }
+      void add(const char *value) {
+        if (this->p + 2 > this->end)
+          return;
+        size_t length = value == NULL ? 0 : strlen(value);
+        if (length > (size_t)(this->end - this->p - 2))
+          length = this->end - this->p - 2;
+        uint8_t type = StringArgument;
+        this->write(&type, 1);
+        if (length > 0)
+          this->write(value, length);
+        this->write("", 1);
+      }
+      void add(char *value) { this->add((const char *)value); }
+      void add(const String &value) { this->add(value.c_str()); }
+
+      void addAll() {}
+      template<typename T, typename... Rest> void addAll(const T &first, const Rest &... rest) {
+        this->add(first);
+        this->addAll(rest...);
+      }
+    };
+
+    static RingBuffer *_buffer;
+    static uint32_t _captured;
+    static uint32_t _processed;
+
+    static void capture(Log::LOGLEVEL level, const char *format, Writer &writer);
+    static void format(const uint8_t *record, size_t size);
+
+    // Arguments for logging right away: Strings become C strings
+    template<typename T> static const T &plain(const T &value) { return value; }
+    static const char *plain(const String &value) { return value.c_str(); }
+
+  public:
+    // Start deferring, with a ring buffer of [size] bytes. When it is full, the oldest messages are dropped
+    static void begin(size_t size);
+    static bool isDeferring() { return _buffer != NULL; }
+
+    // Capture a message
+    template<typename... Args> static void log(Log::LOGLEVEL level, const char *format, const Args &... args) {
+      if (!Log::isEnabled(level))
+        return;
+      // The ring buffer has one producer: other tasks log right away, which hands the message to the loop task
+      if (_buffer == NULL || !LoopTask::isCurrent()) {
+        Log::logMessage(level, format, plain(args)...);
+        return;
+      }
+      uint8_t record[DEFERRED_LOG_MAX_RECORD];
+      Writer writer = { record, record + sizeof(record) };
+      capture(level, format, writer);
+      writer.addAll(args...);
+      if (_buffer->push(record, writer.p - record))
+        _captured++;
+    }
+
+    // Shorthands. Trace and Debug are compiled out below LOG_COMPILE_LEVEL, like the Log ones
+#if LOG_COMPILE_LEVEL > 0
+    template<typename... Args> static void logTrace(const char *, const Args &...) {}
+#else
+    template<typename... Args> static void logTrace(const char *format, const Args &... args) { log(Log::LOGLEVEL::Trace, format, args...); }
+#endif
+#if LOG_COMPILE_LEVEL > 1
+    template<typename... Args> static void logDebug(const char *, const Args &...) {}
+#else
+    template<typename... Args> static void logDebug(const char *format, const Args &... args) { log(Log::LOGLEVEL::Debug, format, args...); }
+#endif
+    template<typename... Args> static void logInformation(const char *format, const Args &... args) { log(Log::LOGLEVEL::Information, format, args...); }
+    template<typename... Args> static void logWarning(const char *format, const Args &... args) { log(Log::LOGLEVEL::Warning, format, args...); }
+    template<typename... Args> static void logError(const char *format, const Args &... args) { log(Log::LOGLEVEL::Error, format, args...); }
+    template<typename... Args> static void logCritical(const char *format, const Args &... args) { log(Log::LOGLEVEL::Critical, format, args...); }
+
+    // Format captured messages and send them to the loggers, for at most [budgetUs] microseconds (0 for all).
+    // Returns the number of messages
+    static int process(unsigned long budgetUs = 0);
+    static bool isEmpty() { return _buffer == NULL || _buffer->isEmpty(); }
+
+    // Messages captured, processed and dropped because the buffer was full, as "key=value;" pairs
+    static String statistics();
+};
+#endif
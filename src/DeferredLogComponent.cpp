@@ -0,0 +1,21 @@
+#include "DeferredLogComponent.h"
+
+DeferredLogComponent::DeferredLogComponent(size_t bufferSize, unsigned long budgetUs, Milliseconds intervalMs)
+  : Component("DeferredLog"),
+  _budgetUs(budgetUs),
+  _intervalMs(intervalMs)
+{
+  // Start capturing right away, so messages logged before setup() are deferred as well
+  DeferredLog::begin(bufferSize);
+}
+
+void DeferredLogComponent::setup() {
+  // Nothing
+}
+
+void DeferredLogComponent::loop() {
+  DeferredLog::process(this->_budgetUs);
+  // Low priority: with nothing left, check again later
+  if (DeferredLog::isEmpty())
+    this->sleepFor(this->_intervalMs);
+}
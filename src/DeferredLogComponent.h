@@ -0,0 +1,23 @@
+#ifndef __DEFERRED_LOG_COMPONENT_H__
+#define __DEFERRED_LOG_COMPONENT_H__
+
+#include <Arduino.h>
+#include "components.h"
+#include "DeferredLog.h"
+
+/***
+ * Formats the messages captured by DeferredLog and sends them to the loggers. It spends at most
+ * [budgetUs] microseconds per loop, and sleeps for [intervalMs] when there is nothing to do
+ */
+class DeferredLogComponent: public Component {
+  private:
+    unsigned long _budgetUs;
+    Milliseconds _intervalMs;
+
+  public:
+    DeferredLogComponent(size_t bufferSize, unsigned long budgetUs = 2000, Milliseconds intervalMs = 20);
+
+    void setup();
+    void loop();
+};
+#endif
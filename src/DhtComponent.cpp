@@ -14,4 +14,7 @@ void DHTComponent::setup()
   this->_dht.begin(this->_pullupTimeUs);
 }
 
-void DHTComponent::loop() {}
\ No newline at end of file
+// Nothing to do in the loop: sleep until woken
+void DHTComponent::loop() {
+  this->sleep();
+}
\ No newline at end of file
@@ -0,0 +1,162 @@
+#include "FileLogger.h"
+
+FileLogger::FileLogger(FS *fs, const char *path, Log::LOGLEVEL minLevel, size_t maxFileSize, int fileCount, size_t bufferSize, Milliseconds flushIntervalMs) :
+  Logger("FileLogger", minLevel, (Print *)NULL),
+  _fs(fs),
+  _path(path),
+  _maxFileSize(maxFileSize),
+  _fileCount(fileCount < 1 ? 1 : fileCount),
+  _flushIntervalMs(flushIntervalMs),
+  _fileSize(0),
+  _buffer(bufferSize == 0 ? NULL : new char[bufferSize]),
+  _bufferSize(bufferSize),
+  _buffered(0),
+  _messages(0),
+  _bytes(0),
+  _writes(0),
+  _syncs(0),
+  _rotations(0),
+  _droppedBytes(0)
+{}
+
+// Open the file for appending, creating its directory if needed
+bool FileLogger::open()
+{
+  if (this->_file)
+    return true;
+
+  int slash = this->_path.lastIndexOf('/');
+  if (slash > 0) {
+    String directory = this->_path.substring(0, slash);
+    if (!this->_fs->exists(directory))
+      this->_fs->mkdir(directory);
+  }
+  this->_file = this->_fs->open(this->_path, "a");
+  if (!this->_file)
+    return false;
+  this->_fileSize = this->_file.size();
+  return true;
+}
+
+// <path>.<n - 2> becomes <path>.<n - 1> and so on, and the file itself becomes <path>.1
+void FileLogger::rotate()
+{
+  if (this->_file)
+    this->_file.close();
+
+  String oldest = this->_path + "." + String(this->_fileCount - 1);
+  if (this->_fileCount > 1 && this->_fs->exists(oldest))
+    this->_fs->remove(oldest);
+  for (int n = this->_fileCount - 2; n >= 1; n--) {
+    String from = this->_path + "." + String(n);
+    if (this->_fs->exists(from))
+      this->_fs->rename(from, this->_path + "." + String(n + 1));
+  }
+  if (this->_fileCount > 1)
+    this->_fs->rename(this->_path, this->_path + ".1");
+  else
+    this->_fs->remove(this->_path);
+
+  this->_fileSize = 0;
+  this->_rotations++;
+}
+
+// Append to the file and make sure it's on flash
+void FileLogger::write(const char *data, size_t size)
+{
+  if (!this->open()) {
+    this->_droppedBytes += size;
+    return;
+  }
+
+  size_t written = this->_file.write((const uint8_t *)data, size);
+  this->_writes++;
+  if (written < size)
+    this->_droppedBytes += size - written;
+  this->_fileSize += written;
+  // Without this, the file system keeps the data until the file is closed, which a restart doesn't do
+  this->_file.flush();
+  this->_syncs++;
+}
+
+void FileLogger::writeBuffer()
+{
+  if (this->_buffered > 0) {
+    this->write(this->_buffer, this->_buffered);
+    this->_buffered = 0;
+  }
+}
+
+// A write that fills up a page of the file. After an early write (e.g. on flush()), the next ones
+// are a bit shorter until the file is at a page boundary again
+size_t FileLogger::bufferTarget()
+{
+  return this->_bufferSize - (this->_fileSize % this->_bufferSize);
+}
+
+bool FileLogger::println(Log::LOGLEVEL level, const char *message)
+{
+  if (level < this->logLevel())
+    return false;
+
+  char line[MAX_LOGMESSAGE_SIZE + 3];
+  size_t size = strlcpy(line, message, MAX_LOGMESSAGE_SIZE + 1);
+  if (size > MAX_LOGMESSAGE_SIZE)
+    size = MAX_LOGMESSAGE_SIZE;
+  line[size++] = '\r';
+  line[size++] = '\n';
+  this->_messages++;
+  this->_bytes += size;
+
+  // Start a new file when the line doesn't fit, rather than split it over two
+  if (this->open()) {
+    size_t pending = this->_fileSize + this->_buffered;
+    if (pending > 0 && pending + size > this->_maxFileSize) {
+      this->writeBuffer();
+      this->rotate();
+    }
+  }
+
+  if (this->_buffer == NULL) {
+    this->write(line, size);
+    return true;
+  }
+
+  if (this->_buffered == 0)
+    this->_flushTime = Deadline::in(this->_flushIntervalMs);
+
+  // Copy the line, writing the buffer each time it reaches the target
+  const char *p = line;
+  while (size > 0) {
+    size_t target = this->bufferTarget();
+    size_t count = target - this->_buffered < size ? target - this->_buffered : size;
+    memcpy(this->_buffer + this->_buffered, p, count);
+    this->_buffered += count;
+    p += count;
+    size -= count;
+    if (this->_buffered >= target) {
+      this->writeBuffer();
+      this->_flushTime = Deadline::in(this->_flushIntervalMs);
+    }
+  }
+  return true;
+}
+
+void FileLogger::drain()
+{
+  if (this->_buffered > 0 && this->_flushTime.hasPassed())
+    this->writeBuffer();
+}
+
+void FileLogger::flush()
+{
+  this->writeBuffer();
+}
+
+String FileLogger::statistics()
+{
+  char buffer[160];
+  snprintf(buffer, sizeof(buffer), "messages=%lu;bytes=%lu;writes=%lu;syncs=%lu;rotations=%lu;dropped=%lu;",
+    this->_messages, this->_bytes, this->_writes, this->_syncs, this->_rotations, this->_droppedBytes);
+  return String(buffer);
+}
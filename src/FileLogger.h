@@ -0,0 +1,70 @@
+#ifndef __FILE_LOGGER_H__
+#define __FILE_LOGGER_H__
+
+#include <Arduino.h>
+#include <FS.h>
+#include "Logging.h"
+#include "Deadline.h"
+
+// The size of a flash page (sector): writes are collected in a buffer of this size
+#ifndef FILE_LOG_PAGE_SIZE
+  #define FILE_LOG_PAGE_SIZE 4096
+#endif
+
+/***
+ * A logger that appends to a file, and keeps older files: when the file reaches [maxFileSize],
+ * <path> becomes <path>.1, <path>.1 becomes <path>.2 and so on, up to <path>.<fileCount - 1>.
+ *
+ * Flash is written a page at a time, so each message doesn't cost a page write of its own.
+ * Messages are collected in a buffer of [bufferSize] bytes, which is written when it is full, when
+ * the oldest message in it is [flushIntervalMs] old, or on flush(), e.g. before a restart. Writes
+ * end on a page boundary of the file where possible. A buffer size of 0 writes every message
+ * right away
+ */
+class FileLogger: public Logger {
+  private:
+    FS *_fs;
+    String _path;
+    size_t _maxFileSize;
+    int _fileCount;
+    Milliseconds _flushIntervalMs;
+
+    File _file;
+    size_t _fileSize;
+    char *_buffer;
+    size_t _bufferSize;
+    size_t _buffered;
+    // When the oldest message in the buffer must be written
+    Deadline _flushTime;
+
+    // Statistics
+    unsigned long _messages;
+    unsigned long _bytes;
+    unsigned long _writes;
+    unsigned long _syncs;
+    unsigned long _rotations;
+    unsigned long _droppedBytes;
+
+    bool open();
+    void rotate();
+    void write(const char *data, size_t size);
+    void writeBuffer();
+    // The number of bytes to buffer before writing, so the write ends on a page boundary
+    size_t bufferTarget();
+
+  public:
+    FileLogger(FS *fs, const char *path, Log::LOGLEVEL minLevel = Log::LOGLEVEL::Warning, size_t maxFileSize = 65536, int fileCount = 4, size_t bufferSize = FILE_LOG_PAGE_SIZE, Milliseconds flushIntervalMs = 10000);
+
+    bool println(Log::LOGLEVEL level, const char *message) override;
+    // Write the buffer when it's due
+    void drain() override;
+    // Write the buffer now
+    void flush() override;
+
+    unsigned long messages() { return this->_messages; }
+    unsigned long writes() { return this->_writes; }
+    unsigned long syncs() { return this->_syncs; }
+    // Messages, bytes, writes, syncs, rotations and bytes dropped (because a write failed) as "key=value;" pairs
+    String statistics();
+};
+#endif
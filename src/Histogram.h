@@ -0,0 +1,67 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A histogram with a fixed number of buckets that grow in powers of two.
+ *
+ * Bucket 0 counts the value 0, bucket i counts values from 2^(i-1) up to 2^i - 1, and the
+ * last bucket counts everything from 2^(Buckets-2) up. Adding a value takes constant time
+ * and no memory. Percentiles are approximate: they return the upper bound of the bucket
+ * that contains them
+ */
+template<size_t Buckets> class Histogram {
+  private:
+    uint32_t _counts[Buckets];
+    uint32_t _total;
+
+  public:
+    Histogram() { this->clear(); }
+
+    void clear() {
+      for (size_t i = 0; i < Buckets; i++)
+        this->_counts[i] = 0;
+      this->_total = 0;
+    }
+
+    // The bucket a value goes in
+    static size_t bucketOf(uint32_t value) {
+      size_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+      return bucket < Buckets ? bucket : Buckets - 1;
+    }
+
+    // The largest value that goes into a bucket. The last bucket has no upper bound
+    static uint32_t upperBound(size_t bucket) {
+      return bucket >= Buckets - 1 ? UINT32_MAX : (bucket == 0 ? 0 : (uint32_t)((1ULL << bucket) - 1));
+    }
+
+    void add(uint32_t value) {
+      this->_counts[bucketOf(value)]++;
+      this->_total++;
+    }
+
+    size_t buckets() const { return Buckets; }
+    uint32_t count(size_t bucket) const { return this->_counts[bucket]; }
+    uint32_t total() const { return this->_total; }
+
+    // The approximate value below which [percent] percent of the values are, e.g. 50 for the median.
+    // For the last bucket, which has no upper bound, [maximum] is returned
+    uint32_t percentile(uint8_t percent, uint32_t maximum) const {
+      if (this->_total == 0)
+        return 0;
+      // The number of values at or below the percentile, rounded up
+      uint32_t target = (uint32_t)(((uint64_t)this->_total * percent + 99) / 100);
+      uint32_t seen = 0;
+      for (size_t i = 0; i < Buckets; i++) {
+        seen += this->_counts[i];
+        if (seen >= target && seen > 0) {
+          uint32_t bound = upperBound(i);
+          return bound < maximum ? bound : maximum;
+        }
+      }
+      return maximum;
+    }
+};
+#endif
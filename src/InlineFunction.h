@@ -0,0 +1,73 @@
+#ifndef __INLINE_FUNCTION_H__
+#define __INLINE_FUNCTION_H__
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+/**
+ * A function object like std::function that stores its callable (e.g. a lambda and its
+ * captures) inside itself, in a buffer of [Size] bytes. It never allocates memory.
+ *
+ * Assigning a callable that does not fit is a compile time error.
+ *
+ * Usage:
+ *   InlineFunction<void(int), 16> f;
+ *   f = [x](int y) { ... };
+ *   f(3);
+ */
+template<typename Signature, size_t Size> class InlineFunction;
+
+template<typename R, typename... Args, size_t Size> class InlineFunction<R(Args...), Size> {
+  private:
+    // Storage for the callable, aligned for anything a lambda can capture
+    alignas(8) unsigned char _buffer[Size];
+    // Call and destroy the callable in the buffer. NULL when empty
+    R (*_invoke)(void *callable, Args... args);
+    void (*_destroy)(void *callable);
+
+  public:
+    InlineFunction() : _invoke(NULL), _destroy(NULL) {}
+    ~InlineFunction() { this->clear(); }
+
+    // The callable cannot be copied or moved out, so neither can the function
+    InlineFunction(const InlineFunction &) = delete;
+    InlineFunction &operator=(const InlineFunction &) = delete;
+
+    // Store a callable, replacing the current one
+    template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+    InlineFunction &operator=(F &&callable) {
+      typedef typename std::decay<F>::type Callable;
+      static_assert(sizeof(Callable) <= Size, "Callable is too large for this InlineFunction, capture less or increase its size");
+      static_assert(alignof(Callable) <= 8, "Callable requires more alignment than InlineFunction provides");
+
+      this->clear();
+      new (this->_buffer) Callable(std::forward<F>(callable));
+      this->_invoke = [](void *c, Args... args) -> R { return (*static_cast<Callable *>(c))(std::forward<Args>(args)...); };
+      this->_destroy = [](void *c) { static_cast<Callable *>(c)->~Callable(); };
+      return *this;
+    }
+
+    // Assigning NULL makes the function empty
+    InlineFunction &operator=(std::nullptr_t) {
+      this->clear();
+      return *this;
+    }
+
+    // Destroy the callable, if any
+    void clear() {
+      if (this->_destroy != NULL)
+        this->_destroy(this->_buffer);
+      this->_invoke = NULL;
+      this->_destroy = NULL;
+    }
+
+    // Call the function. It must not be empty
+    R operator()(Args... args) { return this->_invoke(this->_buffer, std::forward<Args>(args)...); }
+
+    bool isEmpty() const { return this->_invoke == NULL; }
+    bool operator==(std::nullptr_t) const { return this->isEmpty(); }
+    bool operator!=(std::nullptr_t) const { return !this->isEmpty(); }
+};
+#endif
@@ -0,0 +1,128 @@
+#ifndef __INTAKE_QUEUE_H__
+#define __INTAKE_QUEUE_H__
+
+#include <Arduino.h>
+#include <atomic>
+
+#ifndef IRAM_ATTR
+  #define IRAM_ATTR
+#endif
+
+/***
+ * The task that runs loop(). Most of the library may only be used from there; other tasks (and
+ * interrupts) hand their work to it through an IntakeQueue. On ESP8266 there are no other tasks
+ */
+class LoopTask {
+  private:
+#if defined(ESP32)
+    static TaskHandle_t _handle;
+#endif
+
+  public:
+    // Remember the current task as the loop task. Until then, every task counts as the loop task
+    static void capture() {
+#if defined(ESP32)
+      _handle = xTaskGetCurrentTaskHandle();
+#endif
+    }
+
+    // Is the caller the loop task (and not an interrupt)?
+    static bool isCurrent() {
+#if defined(ESP32)
+      return !xPortInIsrContext() && (_handle == NULL || xTaskGetCurrentTaskHandle() == _handle);
+#else
+      return true;
+#endif
+    }
+};
+
+// Copy a string into an entry, cut off at [size] - 1 characters. Calls no library functions, which
+// may not be in IRAM, so it's safe in interrupts
+inline __attribute__((always_inline)) void copyToIntake(char *destination, const char *source, size_t size) {
+  size_t i = 0;
+  if (source != NULL)
+    for (; source[i] != 0 && i < size - 1; i++)
+      destination[i] = source[i];
+  destination[i] = 0;
+}
+
+/**
+ * A bounded queue of [Size] (a power of two) fixed-size entries, for any number of producers and
+ * consumers, that takes no locks and allocates nothing.
+ *
+ * Each cell has a sequence number that says whose turn it is: a producer claims the cell at the
+ * enqueue position by moving the position on, fills it and then hands it to the consumers by
+ * bumping the sequence; a consumer does the same at the dequeue position. Entries are filled and
+ * read in place, by a function, so a large entry never lives on the stack of (say) an interrupt.
+ * When the queue is full, push() drops the entry and counts it
+ */
+template<typename T, size_t Size> class IntakeQueue {
+  static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "IntakeQueue size must be a power of two");
+
+  private:
+    struct Cell {
+      std::atomic<uint32_t> sequence;
+      T data;
+    };
+
+    Cell _cells[Size];
+    std::atomic<uint32_t> _enqueuePosition;
+    std::atomic<uint32_t> _dequeuePosition;
+    std::atomic<uint32_t> _dropped;
+
+  public:
+    IntakeQueue() : _enqueuePosition(0), _dequeuePosition(0), _dropped(0) {
+      for (size_t i = 0; i < Size; i++)
+        this->_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    IntakeQueue(const IntakeQueue &) = delete;
+    IntakeQueue &operator=(const IntakeQueue &) = delete;
+
+    // Add an entry: [fill] is called with the entry to fill in and [args]. Returns false if the queue
+    // was full. Always inlined, so it's in IRAM when its caller is; in an interrupt, make [fill] an
+    // IRAM_ATTR function, as a lambda may not be
+    template<typename F, typename... Args> inline __attribute__((always_inline)) bool push(F fill, Args... args) {
+      uint32_t position = this->_enqueuePosition.load(std::memory_order_relaxed);
+      Cell *cell;
+      for (;;) {
+        cell = &this->_cells[position & (Size - 1)];
+        int32_t difference = (int32_t)(cell->sequence.load(std::memory_order_acquire) - position);
+        if (difference == 0) {
+          if (this->_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            break;
+        } else if (difference < 0) {
+          this->_dropped.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        } else
+          position = this->_enqueuePosition.load(std::memory_order_relaxed);
+      }
+      fill(cell->data, args...);
+      cell->sequence.store(position + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Take the oldest entry: [consume] is called with it. Returns false if the queue was empty
+    template<typename F> bool pop(F consume) {
+      uint32_t position = this->_dequeuePosition.load(std::memory_order_relaxed);
+      Cell *cell;
+      for (;;) {
+        cell = &this->_cells[position & (Size - 1)];
+        int32_t difference = (int32_t)(cell->sequence.load(std::memory_order_acquire) - (position + 1));
+        if (difference == 0) {
+          if (this->_dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            break;
+        } else if (difference < 0)
+          return false;
+        else
+          position = this->_dequeuePosition.load(std::memory_order_relaxed);
+      }
+      consume(cell->data);
+      cell->sequence.store(position + Size, std::memory_order_release);
+      return true;
+    }
+
+    // The number of entries dropped because the queue was full
+    uint32_t dropped() const { return this->_dropped.load(std::memory_order_relaxed); }
+};
+#endif
@@ -1,17 +1,41 @@
 #include <Arduino.h>
 
 #include "logging.h"
+#include "Clock.h"
+#include "RingBuffer.h"
+#include "DeferredLog.h"
 
 Timezone *Log::timezone = NULL;
 const char *Log::timeFormat = LOG_DEFAULT_TIME_FORMAT;
+time_t Log::stampSecond = -1;
+char Log::stampHead[LOG_TIMESTAMP_SIZE] = "";
+char Log::stampTail[LOG_TIMESTAMP_SIZE] = "";
+bool Log::stampHasMilliseconds = false;
 
 // The default logger is the serial logger with level Information
 // Call setSerialLogLevel to change this
 std::vector<Logger *> Log::_loggers = { new SerialLogger(Log::LOGLEVEL::Information) };
+IntakeQueue<LogIntakeEntry, LOG_INTAKE_SLOTS> Log::_intake;
+#if defined(ESP32)
+TaskHandle_t LoopTask::_handle = NULL;
+#endif
+// The level of the default logger
+Log::LOGLEVEL Log::_minLevel = Log::LOGLEVEL::Information;
 
 // Add a logger to the collection of loggers
 void Log::addLogger(Logger *logger) {
   _loggers.push_back(logger);
+  Log::updateMinLevel();
+}
+
+// Called when a logger is added or changes its level
+void Log::updateMinLevel()
+{
+  LOGLEVEL minLevel = LOGLEVEL::None;
+  for (auto logger: Log::_loggers)
+    if (logger->logLevel() < minLevel)
+      minLevel = logger->logLevel();
+  Log::_minLevel = minLevel;
 }
 
 void Log::setSerialLogLevel(LOGLEVEL level)
@@ -24,6 +48,63 @@ void Log::setSerialLogLevel(LOGLEVEL level)
   }
 }
 
+void Log::setSerialBuffer(size_t size)
+{
+  for (auto logger: Log::_loggers) {
+    if (logger->is(SerialLogger::name)) {
+      static_cast<SerialLogger *>(logger)->setBuffer(size);
+      break;
+    }
+  }
+}
+
+void Log::loop()
+{
+  Log::processIntake();
+  for (auto logger: Log::_loggers)
+    logger->drain();
+}
+
+void Log::flush()
+{
+  Log::processIntake();
+  // Captured messages too: before a restart, they're the ones that say why
+  DeferredLog::process();
+  for (auto logger: Log::_loggers)
+    logger->flush();
+}
+
+// The wall clock at the time of the message is now minus its age
+void Log::processIntake()
+{
+  LogIntakeEntry entry;
+  while (Log::_intake.pop([&entry](LogIntakeEntry &queued) { entry = queued; })) {
+    int64_t utcMs = Log::currentUtcMs();
+    if (utcMs >= 0)
+      utcMs -= (uint32_t)(micros() - entry.micros) / 1000;
+
+    char loc_buf[MAX_LOGMESSAGE_SIZE + 1];
+    size_t length = Log::formatPrefix(loc_buf, sizeof(loc_buf), (LOGLEVEL)entry.level, utcMs);
+    strlcpy(loc_buf + length, entry.message, sizeof(loc_buf) - length);
+    Log::dispatch((LOGLEVEL)entry.level, loc_buf);
+  }
+}
+
+// Fill in a message from an interrupt. Not a lambda, so it's in IRAM as well
+static void IRAM_ATTR fillFromISR(LogIntakeEntry &entry, uint8_t level, const char *message)
+{
+  entry.level = level;
+  entry.micros = micros();
+  copyToIntake(entry.message, message, sizeof(entry.message));
+}
+
+void IRAM_ATTR Log::logFromISR(LOGLEVEL level, const char *message)
+{
+  if (!Log::isEnabled(level))
+    return;
+  Log::_intake.push(fillFromISR, (uint8_t)level, message);
+}
+
 Log::LOGLEVEL Log::parseLogLevel(String name, LOGLEVEL defaultLevel)
 {
   if (name.equalsIgnoreCase("N") || name.equalsIgnoreCase("Off") || name.equalsIgnoreCase("None"))
@@ -49,21 +130,53 @@ void Log::setTimezone(Timezone *timezone, const char *format)
 {
   Log::timezone = timezone;
   Log::timeFormat = format;
+  Log::stampSecond = -1;
 }
 
 String Log::getTimeStamp()
 {
-  if (Log::timezone != NULL && Log::timeFormat != NULL && timeStatus() != timeStatus_t::timeNotSet)
-    return timezone->dateTime(timeFormat);
-  else
-    return emptyString;
+  char buffer[LOG_TIMESTAMP_SIZE];
+  Log::formatTimeStamp(buffer, sizeof(buffer));
+  return String(buffer);
 }
 
-void Log::va_logMessage(LOGLEVEL level, const char *format, va_list args)
+// The time from the wall clock, or from eztime if the clock was never synchronized
+int64_t Log::currentUtcMs()
 {
-  char loc_buf[MAX_LOGMESSAGE_SIZE + 1] = "";
+  if (Clock::isSynchronized())
+    return Clock::utcMillis();
+  if (timeStatus() != timeStatus_t::timeNotSet)
+    return (int64_t)UTC.now() * 1000 + UTC.ms(LAST_READ);
+  return -1;
+}
 
-  char *p = stpcpy(loc_buf, getTimeStamp().c_str());
+// Formatting with eztime is expensive, so it's only done when the second changes
+size_t Log::formatTimeStamp(char *buffer, size_t size, int64_t utcMs)
+{
+  buffer[0] = 0;
+  if (Log::timezone == NULL || Log::timeFormat == NULL || utcMs < 0)
+    return 0;
+
+  time_t t = (time_t)(utcMs / 1000);
+  if (t != Log::stampSecond) {
+    // eztime's "v" is the milliseconds of its own clock: insert ours instead
+    const char *v = strchr(Log::timeFormat, 'v');
+    String head = v == NULL ? String(Log::timeFormat) : String(Log::timeFormat).substring(0, v - Log::timeFormat);
+    strlcpy(Log::stampHead, timezone->dateTime(t, UTC_TIME, head).c_str(), sizeof(Log::stampHead));
+    strlcpy(Log::stampTail, v == NULL ? "" : timezone->dateTime(t, UTC_TIME, v + 1).c_str(), sizeof(Log::stampTail));
+    Log::stampHasMilliseconds = v != NULL;
+    Log::stampSecond = t;
+  }
+
+  int length = Log::stampHasMilliseconds
+    ? snprintf(buffer, size, "%s%03u%s", Log::stampHead, (unsigned)(utcMs % 1000), Log::stampTail)
+    : snprintf(buffer, size, "%s", Log::stampHead);
+  return length < 0 ? 0 : ((size_t)length >= size ? size - 1 : (size_t)length);
+}
+
+size_t Log::formatPrefix(char *buffer, size_t size, LOGLEVEL level, int64_t utcMs)
+{
+  char *p = buffer + Log::formatTimeStamp(buffer, size, utcMs);
 
   // // Add time information if available
   // if (timezone != NULL && timeFormat != NULL && timeStatus() != timeStatus_t::timeNotSet)
@@ -96,15 +209,45 @@ void Log::va_logMessage(LOGLEVEL level, const char *format, va_list args)
     break;
   }
   p = stpcpy(p, lvl);
+  return p - buffer;
+}
+
+void Log::dispatch(LOGLEVEL level, const char *message)
+{
+  for (auto logger: Log::_loggers)
+    logger->println(level, message);
+}
+
+void Log::va_logMessage(LOGLEVEL level, const char *format, va_list args)
+{
+  // Don't format what no logger will log
+  if (!Log::isEnabled(level))
+    return;
+
+  // Other tasks format the message themselves, but leave the rest to the loop task
+  if (!LoopTask::isCurrent()) {
+    Log::_intake.push([&](LogIntakeEntry &entry) {
+      entry.level = level;
+      entry.micros = micros();
+      vsnprintf(entry.message, sizeof(entry.message), format, args);
+    });
+    return;
+  }
+
+  char loc_buf[MAX_LOGMESSAGE_SIZE + 1] = "";
+
+  char *p = loc_buf + Log::formatPrefix(loc_buf, sizeof(loc_buf), level, Log::currentUtcMs());
 
   // Print the message info the rest of the buffer
   vsnprintf(p, sizeof(loc_buf) - (p - loc_buf), format, args);
-    for (auto logger: Log::_loggers)
-      logger->println(level, loc_buf);
+  Log::dispatch(level, loc_buf);
 }
 
 void Log::logMessage(LOGLEVEL level, const char *format, ...)
 {
+  if (!Log::isEnabled(level))
+    return;
+
   va_list args;
   va_start(args, format);
 
@@ -123,13 +266,23 @@ void Log::log##LVL(const char *format, ...) { \
 }
 
 // These declare real methods, e.g. Log::logTrace(const char *format, ...)
+// Those below LOG_COMPILE_LEVEL are empty and inline in the header
+#if LOG_COMPILE_LEVEL <= 0
 LOGMESSAGE(Trace)
+#endif
+#if LOG_COMPILE_LEVEL <= 1
 LOGMESSAGE(Debug)
+#endif
 LOGMESSAGE(Information)
 LOGMESSAGE(Warning)
 LOGMESSAGE(Error)
 LOGMESSAGE(Critical)
 
+void Logger::setLogLevel(Log::LOGLEVEL level) {
+  this->_minLevel = level;
+  Log::updateMinLevel();
+}
+
 bool Logger::println(Log::LOGLEVEL level, const char *message) {
   if (level < this->_minLevel)
     return false;
@@ -142,4 +295,79 @@ bool Logger::println(Log::LOGLEVEL level, const char *message) {
   return true;
 }
 
-const char *SerialLogger::name = "SerialLogger";
\ No newline at end of file
+const char *SerialLogger::name = "SerialLogger";
+
+void SerialLogger::setBuffer(size_t size) {
+  // Write out what the current buffer holds first
+  this->flush();
+  delete this->_buffer;
+  this->_buffer = size == 0 ? NULL : new RingBuffer(size, RingBuffer::DropNewest);
+}
+
+bool SerialLogger::println(Log::LOGLEVEL level, const char *message) {
+  if (this->_buffer == NULL)
+    return Logger::println(level, message);
+  if (level < this->logLevel())
+    return false;
+
+  // Keep what is already buffered in order: drop this message if it doesn't fit. Note earlier drops
+  // before it, where they happened
+  if (this->_droppedBytes != this->_notedBytes) {
+    char note[48];
+    int noteLength = this->formatDropNote(note, sizeof(note));
+    if (this->_buffer->push(note, noteLength))
+      this->_notedBytes = this->_droppedBytes;
+  }
+  size_t length = strlen(message);
+  if (!this->_buffer->push(message, length))
+    this->_droppedBytes += length + 2;
+  this->drain();
+  return true;
+}
+
+int SerialLogger::formatDropNote(char *buffer, size_t size) {
+  int length = snprintf(buffer, size, "[%s] %lu bytes dropped", name, (unsigned long)(this->_droppedBytes - this->_notedBytes));
+  return length < (int)size ? length : size - 1;
+}
+
+// Take the next message to write from the buffer, or, when it's empty, the note about the last bytes dropped
+bool SerialLogger::nextMessage() {
+  int length = this->_buffer == NULL ? -1 : this->_buffer->pop(this->_current, sizeof(this->_current) - 2);
+  if (length < 0 && this->_droppedBytes != this->_notedBytes) {
+    length = this->formatDropNote(this->_current, sizeof(this->_current) - 2);
+    this->_notedBytes = this->_droppedBytes;
+  }
+  if (length < 0)
+    return false;
+  this->_current[length++] = '\r';
+  this->_current[length++] = '\n';
+  this->_currentLength = length;
+  this->_currentOffset = 0;
+  return true;
+}
+
+void SerialLogger::drain() {
+  if (this->_buffer == NULL)
+    return;
+  int room;
+  while ((room = Serial.availableForWrite()) > 0) {
+    if (this->_currentOffset >= this->_currentLength && !this->nextMessage())
+      break;
+    size_t count = this->_currentLength - this->_currentOffset;
+    if (count > (size_t)room)
+      count = room;
+    this->_currentOffset += Serial.write((const uint8_t *)this->_current + this->_currentOffset, count);
+  }
+}
+
+void SerialLogger::flush() {
+  if (this->_buffer == NULL)
+    return;
+  while (this->_currentOffset < this->_currentLength || this->nextMessage()) {
+    size_t written = Serial.write((const uint8_t *)this->_current + this->_currentOffset, this->_currentLength - this->_currentOffset);
+    if (written == 0)
+      break;
+    this->_currentOffset += written;
+  }
+  Serial.flush();
+}
\ No newline at end of file
@@ -6,14 +6,48 @@
 #include <Print.h>
 #include <vector>
 #include <functional>
+#include "IntakeQueue.h"
+#include "Clock.h"
 
-#define LOG_DEFAULT_TIME_FORMAT "Y-m-d H:i:s "
+// The eztime format for log time stamps. "v" is milliseconds
+#define LOG_DEFAULT_TIME_FORMAT "Y-m-d H:i:s.v "
+
+// The maximum size of a formatted time stamp
+#ifndef LOG_TIMESTAMP_SIZE
+  #define LOG_TIMESTAMP_SIZE 48
+#endif
 
 #ifndef MAX_LOGMESSAGE_SIZE
   #define MAX_LOGMESSAGE_SIZE 256
 #endif
 
+// Messages below this level are left out at compile time, e.g. -DLOG_COMPILE_LEVEL=2 for release
+// builds: logTrace() and logDebug() calls then compile to empty inline functions and their format
+// strings are left out. LOG_TRACE() and LOG_DEBUG() leave out their arguments as well.
+// 0 = Trace, 1 = Debug, 2 = Information, 3 = Warning, 4 = Error, 5 = Critical
+#ifndef LOG_COMPILE_LEVEL
+  #define LOG_COMPILE_LEVEL 0
+#endif
+
+// Messages logged from other tasks and interrupts wait in a queue of this many entries of this size
+// until the loop task sends them to the loggers
+#ifndef LOG_INTAKE_SLOTS
+  #define LOG_INTAKE_SLOTS 8
+#endif
+#ifndef LOG_INTAKE_MESSAGE_SIZE
+  #define LOG_INTAKE_MESSAGE_SIZE 160
+#endif
+
 class Logger;
+class DeferredLog;
+class RingBuffer;
+
+// A message logged outside the loop task: the level, when (micros(), which is safe in interrupts) and the text
+struct LogIntakeEntry {
+  uint8_t level;
+  uint32_t micros;
+  char message[LOG_INTAKE_MESSAGE_SIZE];
+};
 
 class Log
 {
@@ -24,8 +58,16 @@ private:
   static Timezone *timezone;
   // The format to use for logging
   static const char *timeFormat;
+  // The time stamp is formatted once per second: the second, and the parts before and after the milliseconds
+  static time_t stampSecond;
+  static char stampHead[LOG_TIMESTAMP_SIZE];
+  static char stampTail[LOG_TIMESTAMP_SIZE];
+  static bool stampHasMilliseconds;
 
   static std::vector<Logger *> _loggers;
+  // Messages from other tasks and interrupts
+  static IntakeQueue<LogIntakeEntry, LOG_INTAKE_SLOTS> _intake;
+  static void processIntake();
   
 public:
   // The various log levels
@@ -40,8 +82,13 @@ public:
     None // No logging will happen
   };
 
+  // Would a message with this level be logged by any logger? Use this to skip preparing expensive arguments
+  static bool isEnabled(LOGLEVEL level) { return level >= LOG_COMPILE_LEVEL && level >= Log::_minLevel; }
+
   // Set the minimum log level for the serial logger, if present
   static void setSerialLogLevel(LOGLEVEL level);
+  // Buffer serial output in [size] bytes, so logging doesn't wait for the serial port. 0 writes directly
+  static void setSerialBuffer(size_t size);
   // Set the Timezone object to use for time stamps
   static void setTimezone(Timezone *timezone, const char *format = LOG_DEFAULT_TIME_FORMAT);
 
@@ -50,17 +97,37 @@ public:
 
   static void addLogger(Logger *logger);
 
+  // Send messages from other tasks to the loggers, and let loggers that buffer their output write
+  // some of it, without blocking. Call this from loop()
+  static void loop();
+  // Format captured DeferredLog messages and write out everything buffered, e.g. before a restart. This blocks
+  static void flush();
+
   static LOGLEVEL parseLogLevel(String name, LOGLEVEL defaultLevel);
 
+  // Log a message from an interrupt: the text is logged as is, without formatting. Any log call
+  // from another task is handed to the loop task by itself
+  static void logFromISR(LOGLEVEL level, const char *message);
+  // The number of messages from other tasks and interrupts dropped because the loop task didn't keep up
+  static uint32_t intakeDropped() { return _intake.dropped(); }
+
   // A callback function that gets called for each call to logMessage()
   // static void (*callback)(LOGLEVEL level, const char *message);
 
   // Various logging shorthands
 
   // Log a trace message
+#if LOG_COMPILE_LEVEL > 0
+  template<typename... Args> static void logTrace(const char *, const Args &...) {}
+#else
   static void logTrace(const char *format, ...);
+#endif
   // Log a debug message
+#if LOG_COMPILE_LEVEL > 1
+  template<typename... Args> static void logDebug(const char *, const Args &...) {}
+#else
   static void logDebug(const char *format, ...);
+#endif
   // Log an informational message
   static void logInformation(const char *format, ...);
   // Log a warning
@@ -72,7 +139,23 @@ public:
 
   static String getTimeStamp();
 
+private:
+  // The lowest level any logger logs, so messages below it can be skipped before formatting
+  static LOGLEVEL _minLevel;
+  static void updateMinLevel();
+  friend class Logger;
+  friend class DeferredLog;
+
 protected:
+  // The current time (ms since 1970), or -1 if there is none yet
+  static int64_t currentUtcMs();
+  // Write the time stamp of [utcMs] to [buffer]. Returns its length
+  static size_t formatTimeStamp(char *buffer, size_t size, int64_t utcMs);
+  static size_t formatTimeStamp(char *buffer, size_t size) { return formatTimeStamp(buffer, size, currentUtcMs()); }
+  // Write the time stamp and the level to [buffer]. Returns their length
+  static size_t formatPrefix(char *buffer, size_t size, LOGLEVEL level, int64_t utcMs);
+  // Send a formatted message to all loggers
+  static void dispatch(LOGLEVEL level, const char *message);
   // Interal method to support logXXX shorthands
   static void va_logMessage(LOGLEVEL level, const char *format, va_list args);
 };
@@ -89,14 +172,59 @@ class Logger {
     Logger(const char *name, Log::LOGLEVEL minLevel, Print *destination) : _name(name), _minLevel(minLevel), _destination(destination), _printFunction(NULL) {}
     // A logger with some other println() function
     Logger(const char *name, Log::LOGLEVEL minLevel, std::function<void(const char *)> const printFunction) : _name(name), _minLevel(minLevel), _destination(NULL), _printFunction(printFunction) {}
-    bool println(Log::LOGLEVEL level, const char *message);
+    virtual bool println(Log::LOGLEVEL level, const char *message);
+    // Write out buffered output: as much as can be done without blocking, or all of it
+    virtual void drain() {}
+    virtual void flush() {}
     bool is(const char *name) { return strcmp(this->_name, name) == 0; }
-    void setLogLevel(Log::LOGLEVEL level) { this->_minLevel = level; }
+    void setLogLevel(Log::LOGLEVEL level);
+    Log::LOGLEVEL logLevel() { return this->_minLevel; }
 };
 
+/***
+ * The logger for Serial. By default, it writes directly, which waits for the serial port when
+ * its transmit buffer is full (at 115200 baud, a 256 byte message takes over 20 ms).
+ * setBuffer() makes it copy messages to a ring buffer and only write what the serial port takes
+ * without waiting, the rest on later calls. When the buffer is full, messages are dropped, and
+ * the number of bytes dropped is noted in the output
+ */
 class SerialLogger: public Logger {
+  private:
+    RingBuffer *_buffer;
+    // The message being written (with CR/LF), and how far it got
+    char _current[MAX_LOGMESSAGE_SIZE + 3];
+    size_t _currentLength;
+    size_t _currentOffset;
+    // Bytes dropped, and how many of those were noted in the output
+    uint32_t _droppedBytes;
+    uint32_t _notedBytes;
+
+    bool nextMessage();
+    int formatDropNote(char *buffer, size_t size);
+
   public:
     static const char *name;
-    SerialLogger(Log::LOGLEVEL minLevel = Log::LOGLEVEL::Information) : Logger(name, minLevel, &Serial) {}
+    SerialLogger(Log::LOGLEVEL minLevel = Log::LOGLEVEL::Information) :
+      Logger(name, minLevel, &Serial), _buffer(NULL), _currentLength(0), _currentOffset(0), _droppedBytes(0), _notedBytes(0) {}
+
+    void setBuffer(size_t size);
+    uint32_t droppedBytes() { return this->_droppedBytes; }
+
+    bool println(Log::LOGLEVEL level, const char *message) override;
+    void drain() override;
+    void flush() override;
 };
-#endif
\ No newline at end of file
+
+// Log::logTrace() and Log::logDebug() for arguments that cost something to compute, e.g. a String.
+// Below LOG_COMPILE_LEVEL the empty functions would still evaluate those; these never do
+#if LOG_COMPILE_LEVEL > 0
+  #define LOG_TRACE(...) do { if (0) Log::logTrace(__VA_ARGS__); } while (0)
+#else
+  #define LOG_TRACE(...) Log::logTrace(__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL > 1
+  #define LOG_DEBUG(...) do { if (0) Log::logDebug(__VA_ARGS__); } while (0)
+#else
+  #define LOG_DEBUG(...) Log::logDebug(__VA_ARGS__)
+#endif
+#endif
@@ -16,7 +16,7 @@ MqttApplication::MqttApplication(
   _onlinetopic(String(mqttPrefix) + "/status/" + this->hostname() + "/online"),
   _loopCount(0),
   _autoRestartTimeout(Duration::parse(Application::config("auto-restart-timeout", "0"))),
-  _isFirstConnect(true),
+  _isBootInfoPending(true),
   _onMqttConnected(onConnected),
   _onMqttReceived(onReceived)
   #ifdef SUPPORT_MQTT_OVER_SSL
@@ -78,16 +78,8 @@ void MqttApplication::setup() {
     [this](PubSubClient *client) -> void {
       Log::logDebug("[MqttApplication] Connected to MQTT");
 
-      // Publish our boot time when we connect for the first time
-      if (this->_isFirstConnect && this->bootTimeUtc() != 0) {
-        auto bootTime = (this->bootTimeUtcString() + ": Up since " + this->bootTimeLocalString());
-        Log::logDebug("[MqttApplication] Publishing boot time: %s", bootTime.c_str());
-        this->publishData("boot", NULL, bootTime.c_str(), true);
-        Log::logDebug("[MqttApplication] Publishing MAC address: %s", WiFi.macAddress().c_str());
-        this->publishProperty("MAC", WiFi.macAddress().c_str(), true);
-
-        this->_isFirstConnect = false;
-      }
+      // Publish our boot time if we know it by now; otherwise loop() does once the time is known
+      this->publishBootInfoIfPending();
 
       // We have just connected to the broker. Subscribe to topics here if necessary
       // We subscribe to .../online to detect when someone else marks us as offline ("false")
@@ -99,6 +91,10 @@ void MqttApplication::setup() {
       // Make sure we mark ourselves as online when we reconnect
       this->publishProperty("online", "true", true);
 
+      // Publish our application name and version *retained*. We connect after setup(), so do it here
+      this->publishProperty("application", this->title().c_str(), true);
+      this->publishProperty("version", this->version().c_str(), true);
+
       if (this->_onMqttConnected != NULL) {
         Log::logTrace("[MqttApplication] Calling onMqttConnected");
         this->_onMqttConnected(client);
@@ -110,7 +106,8 @@ void MqttApplication::setup() {
       strncpy(buffer, (const char *)payload, length);
       buffer[length] = '\0';
 
-      Log::logDebug("[MqttApplication] Received '%s': '%s'", topic, buffer);
+      // Called from the MQTT client: keep it short and format the log message later
+      DeferredLog::logDebug("[MqttApplication] Received '%s': '%s'", topic, buffer);
 
       // If it is the online topic...
       if (strcmp(topic, this->_onlinetopic.c_str()) == 0) {
@@ -120,7 +117,7 @@ void MqttApplication::setup() {
           this->publishProperty("online", "true", true);
       } else {
         if (this->_onMqttReceived != NULL) {
-          Log::logTrace("[MqttApplication] Calling onMqttReceived");
+          DeferredLog::logTrace("[MqttApplication] Calling onMqttReceived");
           this->_onMqttReceived(topic, payload, length);
         }
       }
@@ -136,13 +133,31 @@ void MqttApplication::setup() {
   #endif
   ));
 
-  // Set up an MqttLogger with the specified level (or Warning):
+  // The backlog in bytes. Older configurations give mqttlog-size instead, a number of messages:
+  // make room for that many full-size messages, but keep it within what the heap can spare
+  int mqttLogBuffer = atoi(this->config("mqttlog-buffer", "0"));
+  int mqttLogSize = atoi(this->config("mqttlog-size", "0"));
+  if (mqttLogBuffer <= 0 && mqttLogSize > 0) {
+    mqttLogBuffer = mqttLogSize * MAX_LOGMESSAGE_SIZE;
+    if (mqttLogBuffer > MQTT_LOG_MAX_LEGACY_BUFFER)
+      mqttLogBuffer = MQTT_LOG_MAX_LEGACY_BUFFER;
+    Log::logWarning("[MqttApplication] mqttlog-size (%d messages) is deprecated, using mqttlog-buffer=%d (bytes)", mqttLogSize, mqttLogBuffer);
+  }
+  if (mqttLogBuffer <= 0)
+    mqttLogBuffer = 8192;
+
+  // Set up an MqttLogger with the specified level (or Warning), and a backlog of 8 KB that drops the oldest messages when full:
   this->addComponent(_mqttLog = new MqttLogComponent(
     this->mqtt(),
     (this->_mqttPrefix + "/status/" + this->hostname() + "/log").c_str(),
-    atoi(this->config("mqttlog-size", "1000")),
-    Log::parseLogLevel(this->config("mqttlog-level", "Warning"), Log::LOGLEVEL::Warning)
+    mqttLogBuffer,
+    Log::parseLogLevel(this->config("mqttlog-level", "Warning"), Log::LOGLEVEL::Warning),
+    MqttLogger::parsePolicy(this->config("mqttlog-overflow", "oldest"), RingBuffer::DropOldest)
   ));
+  // Catch up after an outage in small steps: by default at most 20 ms per loop, one message per publish
+  _mqttLog->logger()->setBatching(atoi(this->config("mqttlog-batch", "0")));
+  _mqttLog->logger()->setBudget(atol(this->config("mqttlog-budget", "20")) * 1000, atoi(this->config("mqttlog-budget-bytes", "0")));
+  _mqttLog->logger()->setMaxRate(atof(this->config("mqttlog-rate", "0")));
 
   // Auto-restart task (15m)
   if (this->_autoRestartTimeout > 0) {
@@ -174,12 +189,14 @@ void MqttApplication::setup() {
           if (inRestartTimeRange) {
             Log::logInformation("Uptime > %d seconds, restarting...", this->_autoRestartTimeout);
             this->publishProperty("autorestart", (UTC.dateTime("Y-m-d H:i:s") + " (" + this->formatDuration(Duration(uptimeSeconds)) + "/" + String(uptimeSeconds) + "s)").c_str(), true);
-            // Wait a bit
-            delay(5000);
-            // Perform a clean disconnect from MQTT
-            this->mqtt()->mqttClient()->disconnect();
-            // Then restart
-            ESP.restart();
+            // Wait a bit, without blocking the loop, so the property gets published
+            this->addTimeout("Auto-restart", 5000, [this]() {
+              // Perform a clean disconnect from MQTT
+              this->mqtt()->mqttClient()->disconnect();
+              // Write out buffered log messages, then restart
+              Log::flush();
+              ESP.restart();
+            });
           } else {
             Log::logInformation("Uptime > %ld minutes, but hour (%d) is not %d-%d.", uptimeSeconds / 60, this->time()->TZ()->hour(), autoRestartHourMin, autoRestartHourMax);
           }
@@ -209,6 +226,9 @@ void MqttApplication::setup() {
       auto bssid = WiFi.BSSIDstr();
       Log::logInformation("BSSID is now %s", bssid.c_str());
       this->publishProperty("BSSID", bssid.c_str());
+
+      this->publishProperty("wifi", this->wifi()->statistics().c_str());
+      this->publishProperty("wifi-states", this->wifi()->stateTimes().c_str());
     });
   }
 
@@ -252,13 +272,36 @@ void MqttApplication::setup() {
 #endif
       if (this->_loopCount > 1)
         this->publishProperty("loops", String(loopSpeed).c_str());
+      // The MQTT log backlog, including the number of messages dropped because it was full
+      this->publishProperty("mqttlog", this->_mqttLog->logger()->statistics().c_str());
+      // With profiling on, also publish how long a loop takes (us)
+      const LoopProfile *profile = Components::profile();
+      if (profile != NULL && profile->count() > 0) {
+        auto loopTime =
+          "mean=" + String(ProfileClock::microseconds(profile->meanTicks()), 1) +
+          ";p99=" + String(ProfileClock::microseconds(profile->percentileTicks(99)), 1) +
+          ";max=" + String(ProfileClock::microseconds(profile->maxTicks()), 1) + ";";
+        this->publishProperty("looptime", loopTime.c_str());
+      }
       this->_loopCount = 0;
     });
   }
 
-  // Publish our application name and version *retained*
-  this->publishProperty("application", this->title().c_str(), true);
-  this->publishProperty("version", this->version().c_str(), true);
+  // Publish task statistics as status/<host>/tasks/<task name> (off by default)
+  auto tasksInterval = Duration::parse(this->config("tasks-interval", "0"));
+  if (tasksInterval > 0) {
+    this->addTask("Publish task statistics", tasksInterval * 1000, [this]() {
+      this->tasks()->forEach([this](Task *task) {
+        // "Check auto-restart" becomes tasks/Check-auto-restart: no spaces, and no '/', '+' or '#', which mean something in a topic
+        char property[6 + TASK_NAME_SIZE] = "tasks/";
+        char *p = property + 6;
+        for (const char *name = task->name(); *name != 0; name++)
+          *p++ = strchr(" /+#", *name) != NULL ? '-' : *name;
+        *p = 0;
+        this->publishProperty(property, task->statistics().c_str());
+      });
+    });
+  }
 
   // Mark ourselves as online (retained!)
   // publishpublishProperty("online", "true", true); // Do this on MQTT connected
@@ -266,10 +309,31 @@ void MqttApplication::setup() {
 
 void MqttApplication::loop() {
   Application::loop();
+  // The time may become available after we connected
+  if (this->_isBootInfoPending)
+    this->publishBootInfoIfPending();
+  // Publish what other tasks and interrupts handed us
+  MqttIntakeEntry entry;
+  while (this->_intake.pop([&entry](MqttIntakeEntry &queued) { entry = queued; }))
+    this->publishData(entry.channel, entry.hasProperty ? entry.property : NULL, entry.value, entry.retained);
   // Increment our loop count
   this->_loopCount++;
 }
 
+// Publish our boot time and MAC address (retained) once, as soon as we know the time and are connected
+void MqttApplication::publishBootInfoIfPending() {
+  if (!this->_isBootInfoPending || this->bootTimeUtc() == 0 || this->_mqtt == NULL || !this->_mqtt->mqttClient()->connected())
+    return;
+
+  auto bootTime = (this->bootTimeUtcString() + ": Up since " + this->bootTimeLocalString());
+  LOG_DEBUG("[MqttApplication] Publishing boot time: %s", bootTime.c_str());
+  this->publishData("boot", NULL, bootTime.c_str(), true);
+  LOG_DEBUG("[MqttApplication] Publishing MAC address: %s", WiFi.macAddress().c_str());
+  this->publishProperty("MAC", WiFi.macAddress().c_str(), true);
+
+  this->_isBootInfoPending = false;
+}
+
 // // Override of setBootTimeUtc, which is called when the time becomes available.
 // // First set the time in the base class, then publish it using MQTT
 // void MqttApplication::setBootTimeUtc(time_t utc) {
@@ -281,6 +345,17 @@ void MqttApplication::loop() {
 // }
 
 void MqttApplication::publishData(const char *channel, const char *property, const char *value, bool retained) {
+  if (!LoopTask::isCurrent()) {
+    this->_intake.push([&](MqttIntakeEntry &entry) {
+      copyToIntake(entry.channel, channel, sizeof(entry.channel));
+      copyToIntake(entry.property, property, sizeof(entry.property));
+      entry.hasProperty = property != NULL;
+      copyToIntake(entry.value, value, sizeof(entry.value));
+      entry.retained = retained;
+    });
+    return;
+  }
+
   if (this->_mqtt != NULL) {
     char topic[256];
     if (property == NULL)
@@ -299,3 +374,18 @@ void MqttApplication::publishProperty(const char *property, const char *value, b
 {
   this->publishData("status", property, value, retained);
 }
+
+// Fill in a publish from an interrupt. Not a lambda, so it's in IRAM as well
+static void IRAM_ATTR fillFromISR(MqttIntakeEntry &entry, const char *property, const char *value, bool retained)
+{
+  copyToIntake(entry.channel, "status", sizeof(entry.channel));
+  copyToIntake(entry.property, property, sizeof(entry.property));
+  entry.hasProperty = property != NULL;
+  copyToIntake(entry.value, value, sizeof(entry.value));
+  entry.retained = retained;
+}
+
+void IRAM_ATTR MqttApplication::publishPropertyFromISR(const char *property, const char *value, bool retained)
+{
+  this->_intake.push(fillFromISR, property, value, retained);
+}
@@ -7,6 +7,28 @@
 
 #include <WiFiClientSecure.h>
 
+// Publishes from other tasks and interrupts wait in a queue of this many entries until the loop task sends them
+#ifndef MQTT_INTAKE_SLOTS
+  #define MQTT_INTAKE_SLOTS 8
+#endif
+#ifndef MQTT_INTAKE_VALUE_SIZE
+  #define MQTT_INTAKE_VALUE_SIZE 128
+#endif
+
+// The largest MQTT log backlog (bytes) made from the old mqttlog-size setting (a number of messages)
+#ifndef MQTT_LOG_MAX_LEGACY_BUFFER
+  #define MQTT_LOG_MAX_LEGACY_BUFFER 16384
+#endif
+
+// A publish from outside the loop task
+struct MqttIntakeEntry {
+  char channel[16];
+  char property[48];
+  bool hasProperty;
+  char value[MQTT_INTAKE_VALUE_SIZE];
+  bool retained;
+};
+
 class MqttApplication: public Application {
 private:
   static MqttApplication *_app;
@@ -16,10 +38,16 @@ private:
   String _onlinetopic;
   long _loopCount;
   long _autoRestartTimeout;
-  bool _isFirstConnect;
+  // Boot time and MAC address still to be published: NTP usually syncs after we connect
+  bool _isBootInfoPending;
 
   MqttLogComponent *_mqttLog = NULL;
 
+  void publishBootInfoIfPending();
+
+  // Publishes from other tasks and interrupts
+  IntakeQueue<MqttIntakeEntry, MQTT_INTAKE_SLOTS> _intake;
+
   std::function<void(PubSubClient *client)> const _onMqttConnected;
   std::function<void(const char *topic, const byte *payload, unsigned int length)> const _onMqttReceived;
 
@@ -39,8 +67,13 @@ public:
 
   void setBootTimeUtc(time_t utc);
 
+  // Publish to <prefix>/<channel>/<host>[/<property>]. From another task, the publish is handed to the loop task
   void publishData(const char *channel, const char *property, const char *value, bool retained);
   void publishProperty(const char *property, const char *value, bool retained = false);
+  // Publish a property from an interrupt
+  void publishPropertyFromISR(const char *property, const char *value, bool retained = false);
+  // The number of publishes from other tasks and interrupts dropped because the loop task didn't keep up
+  uint32_t intakeDropped() { return this->_intake.dropped(); }
 
   MqttLogComponent *mqttLog() { return this->_mqttLog; }
 };
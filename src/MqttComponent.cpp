@@ -29,11 +29,14 @@ MqttComponent::MqttComponent(
   _mqttClient(broker, portNumber, onReceived, *client),
   _onConnected(onConnected),
   _intervalMs(intervalMs),
+  _lastCheckTime(0),
   _willTopic(willTopic),
   _willMessage(willMessage),
   _willRetain(willRetain),
   _willQos(willQos)
 {
+  this->needs(NetworkCapability);
+
   if (keepAlive != 0) {
     Log::logDebug("[%s] Setting keepalive to %d seconds", this->name(), keepAlive);
     _mqttClient.setKeepAlive(keepAlive);
@@ -64,6 +67,7 @@ void MqttComponent::reconnect()
     ))
     {
       Log::logInformation("[%s] Connected with client ID '%s'.", this->name(), clientId.c_str());
+      this->setReady(true);
       if (this->_onConnected != NULL) {
         Log::logTrace("[%s] Calling onConnected...", name());
         this->_onConnected(&this->_mqttClient);
@@ -74,28 +78,48 @@ void MqttComponent::reconnect()
       Log::logError("[%s] Connection failed, state = %d", this->name(), this->_mqttClient.state());
     }
   }
+  // Still connected after the network came back? Then we're ready again
+  this->setReady(this->_mqttClient.connected());
 }
 
-// setup() the component: connect
+// setup() the component: connect. This is called when the network is available
 void MqttComponent::setup()
 {
+  this->setReady(false);
+  this->reconnect();
+  this->_lastCheckTime = Deadline::now();
+}
+
+// The network is back: reconnect right away instead of waiting for the next check
+void MqttComponent::onCapabilityReady(uint16_t capabilities)
+{
+  Log::logDebug("[%s] Network available, reconnecting...", name());
   this->reconnect();
-  this->_lastCheckTime = millis();
+  this->_lastCheckTime = Deadline::now();
+}
+
+// The network is gone, so is the connection to the broker
+void MqttComponent::onCapabilityLost(uint16_t capabilities)
+{
+  this->setReady(false);
 }
 
 // loop() for Mqtt
 void MqttComponent::loop()
 {
-  if (millis() > this->_lastCheckTime + this->_intervalMs)
+  if ((this->_lastCheckTime + this->_intervalMs).hasPassed())
   {
     Log::logDebug("[%s] Checking connection...", name());
     if (!this->_mqttClient.connected()) {
       Log::logWarning("[%s] Connection lost, reconnecting...", name());
+      this->setReady(false);
       this->reconnect();
-    } else
+    } else {
       Log::logDebug("[%s] Connected.", name());
+      this->setReady(true);
+    }
 
-    this->_lastCheckTime = millis();
+    this->_lastCheckTime = Deadline::now();
   }
 
   this->_mqttClient.loop();
@@ -7,6 +7,10 @@
 
 #include "components.h"
 
+/***
+ * A component that connects to an MQTT broker once the network is available, and checks the
+ * connection every [intervalMs] or when the network comes back. It is ready when connected
+ */
 class MqttComponent: public Component {
   private:
     String _username;
@@ -15,7 +19,7 @@ class MqttComponent: public Component {
     PubSubClient _mqttClient;
     std::function<void(PubSubClient *)> const _onConnected;
     unsigned long _intervalMs;
-    unsigned long _lastCheckTime;
+    Deadline _lastCheckTime;
     String _willTopic;
     String _willMessage;
     bool _willRetain; 
@@ -44,5 +48,7 @@ class MqttComponent: public Component {
 
     void setup();
     void loop();
+    void onCapabilityReady(uint16_t capabilities);
+    void onCapabilityLost(uint16_t capabilities);
 };
 #endif
\ No newline at end of file
@@ -1,8 +1,8 @@
 #include "MqttLogComponent.h"
 
-MqttLogComponent::MqttLogComponent(MqttComponent *mqtt, const char *topic, int size, Log::LOGLEVEL level)
+MqttLogComponent::MqttLogComponent(MqttComponent *mqtt, const char *topic, int bufferSize, Log::LOGLEVEL level, RingBuffer::OverflowPolicy policy)
   : Component("MqttLog"),
-  _mqttLogger(new MqttLogger(mqtt, topic, size, level))
+  _mqttLogger(new MqttLogger(mqtt, topic, bufferSize, level, policy))
 {
   // Add the MQTT logger to the logger list
   Log::addLogger(this->_mqttLogger);
@@ -11,7 +11,7 @@ class MqttLogComponent: public Component {
     MqttLogger *_mqttLogger;
 
   public:
-    MqttLogComponent(MqttComponent *mqtt, const char *topic, int size, Log::LOGLEVEL level);
+    MqttLogComponent(MqttComponent *mqtt, const char *topic, int bufferSize, Log::LOGLEVEL level, RingBuffer::OverflowPolicy policy = RingBuffer::DropOldest);
 
     void setup();
     void loop();
@@ -1,4 +1,5 @@
 #include "MqttLogger.h"
+#include "Clock.h"
 
 // #define LOG
 
@@ -6,27 +7,94 @@
  * MqttLogger class. Saves logged messages in a backlog buffer and publishes
  * them as soon as loop() is called and the Mqtt client is connected.
  */
-MqttLogger::MqttLogger(MqttComponent *mqtt, const char *topic, int max_size, Log::LOGLEVEL minLevel) : 
+MqttLogger::MqttLogger(MqttComponent *mqtt, const char *topic, int buffer_size, Log::LOGLEVEL minLevel, RingBuffer::OverflowPolicy policy) : 
   Logger("MqttLogger", minLevel, [this](const char *message) {
     // Save the message in the backlog UNLESS WE'RE ALREADY SENDING
-    if (!_blocked) {
+    if (!_isPublishing.load(std::memory_order_acquire)) {
       // Capture the log message
 #ifdef LOG
       Serial.println(String(">>> MQTT: ") + message);
 #endif
-      // Push message onto backlog, including timestamp
-      _backlog.push(message);
-
-      // Remove excess entries from backlog
-      while ((int)_backlog.size() > _max_size)
-        _backlog.pop();
+      // Push message onto backlog, including timestamp. If it's full, this drops a message
+      _backlog.push(message, strlen(message));
     }
   }),
   _mqtt(mqtt),
   _topic(String(topic)),
-  _max_size(max_size)
+  _backlog(buffer_size, policy),
+  _isPublishing(false),
+  _batchSize(0),
+  _batch(NULL),
+  _pendingLength(-1),
+  _budgetUs(0),
+  _budgetBytes(0),
+  _publishIntervalMs(0),
+  _publishes(0),
+  _failedPublishes(0)
 {}
 
+void MqttLogger::setBatching(size_t maxPayload)
+{
+  delete[] this->_batch;
+  this->_batch = NULL;
+  this->_batchSize = maxPayload;
+  if (maxPayload > 0) {
+    this->_batch = new char[maxPayload];
+    // PubSubClient drops publishes that don't fit in its buffer (256 bytes by default): make room for a batch
+    uint16_t needed = maxPayload + this->_topic.length() + 16;
+    if (this->_mqtt->mqttClient()->getBufferSize() < needed)
+      this->_mqtt->mqttClient()->setBufferSize(needed);
+  }
+}
+
+void MqttLogger::setBudget(unsigned long microseconds, size_t bytes)
+{
+  this->_budgetUs = microseconds;
+  this->_budgetBytes = bytes;
+}
+
+void MqttLogger::setMaxRate(float publishesPerSecond)
+{
+  this->_publishIntervalMs = publishesPerSecond > 0 ? (Milliseconds)(1000 / publishesPerSecond) : 0;
+}
+
+// Make sure the next message from the backlog is in _pending. Returns its length, or -1 if there is none
+int MqttLogger::takePending()
+{
+  if (this->_pendingLength < 0)
+    this->_pendingLength = this->_backlog.pop(this->_pending, sizeof(this->_pending));
+  return this->_pendingLength;
+}
+
+// The next payload to publish: one message, or as many as fit in a batch. Returns its length, 0 if there is nothing to publish
+size_t MqttLogger::nextPayload(const char **payload)
+{
+  if (this->_batchSize == 0) {
+    if (this->takePending() < 0)
+      return 0;
+    *payload = this->_pending;
+    size_t length = this->_pendingLength;
+    this->_pendingLength = -1;
+    return length;
+  }
+
+  size_t length = 0;
+  while (this->takePending() >= 0) {
+    size_t separator = length > 0 ? 1 : 0;
+    // Messages that don't fit go in the next batch, except in an empty one, where they are cut off
+    if (length > 0 && length + separator + this->_pendingLength > this->_batchSize)
+      break;
+    if (separator)
+      this->_batch[length++] = '\n';
+    size_t copied = (size_t)this->_pendingLength < this->_batchSize - length ? this->_pendingLength : this->_batchSize - length;
+    memcpy(this->_batch + length, this->_pending, copied);
+    length += copied;
+    this->_pendingLength = -1;
+  }
+  *payload = this->_batch;
+  return length;
+}
+
 /**
  * Send the back-log to the Mqtt broker
  * NOT ANYMORE: If we have a continuous connection, send the message without a timestamp. The timestamp will be added by the logger.
@@ -38,11 +106,11 @@ void MqttLogger::loop() {
   // static bool missedBacklog = false;
 
   // If there is a backlog, send it here:
-  if (!_backlog.empty()) {
+  if (_pendingLength >= 0 || !_backlog.isEmpty()) {
     // Are we connected?
     if (_mqtt->mqttClient()->connected()) {
       // Block re-entry
-      _blocked = true;
+      _isPublishing.store(true, std::memory_order_release);
 #ifdef LOG
       Serial.println("--- Start of backlog");
 #endif
@@ -50,24 +118,36 @@ void MqttLogger::loop() {
       // timeStamp.trim();
       // timeStamp = String("[") + timeStamp + String("] ");
 
-      while (!_backlog.empty()) {
-        auto message = _backlog.front();
+      Microseconds startTime = Clock::micros64();
+      size_t bytes = 0;
+      const char *payload;
+      size_t length;
+      // Publish until the backlog is empty, or the rate or the budget says to continue on the next loop
+      while ((_publishIntervalMs == 0 || _nextPublishTime.hasPassed()) && (length = nextPayload(&payload)) > 0) {
 #ifdef LOG
-        Serial.println(msg);
+        Serial.write((const uint8_t *)payload, length);
+        Serial.println();
 #endif
         // // Log with extra time stamp if we have missed backlog entries
         // if (missedBacklog) {
         //   _mqtt->mqttClient()->publish(_topic.c_str(), (timeStamp + message).c_str());
         // } else {
-          _mqtt->mqttClient()->publish(_topic.c_str(), message.c_str());
+          if (_mqtt->mqttClient()->publish(_topic.c_str(), (const uint8_t *)payload, length, false))
+            _publishes++;
+          else
+            _failedPublishes++;
         // }
-        _backlog.pop();
+        bytes += length;
+        if (_publishIntervalMs > 0)
+          _nextPublishTime = Deadline::in(_publishIntervalMs);
+        if ((_budgetBytes > 0 && bytes >= _budgetBytes) || (_budgetUs > 0 && Clock::micros64() - startTime >= _budgetUs))
+          break;
       }
 #ifdef LOG
       Serial.println("--- End of backlog");
 #endif
       // Allow re-entry
-      _blocked = false;
+      _isPublishing.store(false, std::memory_order_release);
       // // Solved missing backlog
       // missedBacklog = false;
     }
@@ -78,3 +158,21 @@ void MqttLogger::loop() {
     // }
   }
 }
+
+String MqttLogger::statistics()
+{
+  char buffer[120];
+  snprintf(buffer, sizeof(buffer), "size=%u;used=%u;dropped=%lu;publishes=%lu;failed=%lu;",
+    (unsigned)this->_backlog.capacity(), (unsigned)this->_backlog.used(), (unsigned long)this->_backlog.dropped(),
+    this->_publishes, this->_failedPublishes);
+  return String(buffer);
+}
+
+RingBuffer::OverflowPolicy MqttLogger::parsePolicy(String name, RingBuffer::OverflowPolicy defaultPolicy)
+{
+  if (name.equalsIgnoreCase("oldest"))
+    return RingBuffer::DropOldest;
+  if (name.equalsIgnoreCase("newest"))
+    return RingBuffer::DropNewest;
+  return defaultPolicy;
+}
@@ -2,26 +2,69 @@
 #define __MQTT_LOGGER_H__
 
 #include <Arduino.h>
+#include <atomic>
 #include "Logging.h"
 #include "MqttComponent.h"
-
-#include <queue>
+#include "RingBuffer.h"
+#include "Deadline.h"
 
 /*
  * MqttLogger class. Saves logged messages in a backlog buffer and publishes
  * them as soon as loop() is called and the Mqtt client is connected.
+ *
+ * The backlog is a ring buffer of [buffer_size] bytes, allocated once, so an MQTT outage costs
+ * no more memory than that. When it is full, the oldest or the newest messages are dropped,
+ * and counted. Messages are added by the code that logs and published from loop()
+ *
+ * By default, loop() publishes the whole backlog, one message per publish. To catch up after an
+ * outage without stalling the loop or flooding the broker, setBatching() packs several messages
+ * into one publish, setBudget() limits the time and bytes of a single loop() and setMaxRate()
+ * limits the number of publishes per second
  */
 class MqttLogger: public Logger {
 private:
   MqttComponent *_mqtt;
   String _topic;
-  int _max_size;
-  
-  std::queue<String> _backlog = std::queue<String>();
-  bool _blocked = false;
+
+  RingBuffer _backlog;
+  // Messages logged while publishing (e.g. about publishing) are not added to the backlog
+  std::atomic<bool> _isPublishing;
+
+  // The maximum payload of a batch of messages, separated by newlines, 0 for one message per publish
+  size_t _batchSize;
+  char *_batch;
+  // The message taken from the backlog that didn't fit in the last batch, if any
+  char _pending[MAX_LOGMESSAGE_SIZE + 1];
+  int _pendingLength;
+  // The time (us) and bytes one loop() may spend publishing, 0 for no limit
+  unsigned long _budgetUs;
+  size_t _budgetBytes;
+  // The minimum time between publishes (ms), 0 for no limit
+  Milliseconds _publishIntervalMs;
+  Deadline _nextPublishTime;
+  // Statistics
+  unsigned long _publishes;
+  unsigned long _failedPublishes;
+
+  int takePending();
+  size_t nextPayload(const char **payload);
 
 public:
-  MqttLogger(MqttComponent *mqtt, const char *topic, int max_size, Log::LOGLEVEL minLevel = Log::LOGLEVEL::None);
+  MqttLogger(MqttComponent *mqtt, const char *topic, int buffer_size, Log::LOGLEVEL minLevel = Log::LOGLEVEL::None, RingBuffer::OverflowPolicy policy = RingBuffer::DropOldest);
   void loop();
+
+  // Pack messages into publishes of up to [maxPayload] bytes. 0 publishes each message on its own
+  void setBatching(size_t maxPayload);
+  // Limit the time (us) and bytes a single loop() spends publishing. 0 is no limit
+  void setBudget(unsigned long microseconds, size_t bytes);
+  // Limit the number of publishes per second. 0 is no limit
+  void setMaxRate(float publishesPerSecond);
+
+  // The number of messages dropped because the backlog was full
+  uint32_t dropped() { return this->_backlog.dropped(); }
+  // Backlog size, use, dropped messages and publishes as "key=value;" pairs
+  String statistics();
+
+  static RingBuffer::OverflowPolicy parsePolicy(String name, RingBuffer::OverflowPolicy defaultPolicy);
 };
-#endif
\ No newline at end of file
+#endif
@@ -6,7 +6,9 @@ OledComponent::OledComponent(int sda, int scl, uint8_t address) :
   Component("OLED"),
   _sda(sda),
   _scl(scl),
-  _address(address)
+  _address(address),
+  _display(NULL),
+  _flashStep(2)
 {}
 
 void OledComponent::setup() {
@@ -20,18 +22,31 @@ void OledComponent::setup() {
     this->_display->clearDisplay();
     this->_display->display();
 
-    this->_display->invertDisplay(false);
-    delay(1000);
-    this->_display->invertDisplay(true);
-    delay(1000);
-    this->_display->invertDisplay(false);
-
     this->_display->setTextColor(WHITE);
     this->_display->setTextSize(1);
     this->_display->setCursor(0, 0);
-    Log::logDebug("Display initialized.");
+
+    // Flash the display from loop(): inverted for a second, then normal
+    this->_display->invertDisplay(false);
+    this->_flashStep = 0;
+    this->setReady(false);
+    this->sleepFor(1000);
   }
 }
 
+// Flash the display after setup(), then sleep until woken
 void OledComponent::loop() {
+  if (this->_flashStep == 0) {
+    this->_display->invertDisplay(true);
+    this->_flashStep++;
+    this->sleepFor(1000);
+    return;
+  }
+  if (this->_flashStep == 1) {
+    this->_display->invertDisplay(false);
+    this->_flashStep++;
+    this->setReady(true);
+    Log::logDebug("Display initialized.");
+  }
+  this->sleep();
 }
@@ -10,6 +10,8 @@ class OledComponent: public Component {
     int _scl;
     int _address;
     Adafruit_SSD1306 *_display;
+    // Where flashing the display after setup() is at. 2 when done
+    uint8_t _flashStep;
 
   public:
     OledComponent(int sda, int scl, uint8_t address);
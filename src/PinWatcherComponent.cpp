@@ -1,5 +1,6 @@
 #include "PinWatcherComponent.h"
 #include "Logging.h"
+#include "DeferredLog.h"
 
 DigitalPinWatcherComponent::DigitalPinWatcherComponent(uint8_t pinNumber, uint8_t inputMode, std::function<void(int, int)> const onValueChanged, const char *name) :
   PinWatcherComponent(name == NULL ? "DigitalPin" : name, pinNumber, onValueChanged),
@@ -18,7 +19,7 @@ void DigitalPinWatcherComponent::setup() {
 void DigitalPinWatcherComponent::loop() {
   int currentValue = digitalRead(this->_pinNumber);
   if (currentValue != this->_lastValue) {
-    Log::logDebug("[%s] Pin %d is now %d", this->name(), this->_pinNumber, currentValue);
+    DeferredLog::logDebug("[%s] Pin %d is now %d", this->name(), this->_pinNumber, currentValue);
     this->_onValueChanged(this->_lastValue, currentValue);
     this->_lastValue = currentValue;
   }
@@ -46,7 +47,7 @@ void AnalogPinWatcherComponent::loop() {
     // Makesure uint16_t does now wrap below 0
     uint16_t minValue = this->_lastValue >= this->_delta ? this->_lastValue - this->_delta : 0;
     if (currentValue < minValue || currentValue > this->_lastValue + this->_delta) {
-      Log::logDebug("[%s] Pin %d is now %d", this->name(), this->_pinNumber, currentValue);
+      DeferredLog::logDebug("[%s] Pin %d is now %d", this->name(), this->_pinNumber, currentValue);
       this->_onValueChanged(this->_lastValue, currentValue);
       this->_lastValue = currentValue;
     }
@@ -69,15 +70,15 @@ DigitalClickWatcherComponent::DigitalClickWatcherComponent(
       // Also: check that we're not within 100 ms of the last click
       if (this->_clickCount != 0 && timestamp - this->_lastTimestamp < 100) {
         // Ignore this input change, it's not a click
-        Log::logTrace("[%s] Ignoring click on pin %d within %ld ms", this->name(), this->_pinNumber, timestamp - this->_lastTimestamp);
+        DeferredLog::logTrace("[%s] Ignoring click on pin %d within %ld ms", this->name(), this->_pinNumber, timestamp - this->_lastTimestamp);
       } else {
         // We detected a click!
-        Log::logDebug("[%s] Click detected on pin %d (now %d)", this->name(), this->_pinNumber, currentValue);
+        DeferredLog::logDebug("[%s] Click detected on pin %d (now %d)", this->name(), this->_pinNumber, currentValue);
         this->_clickCount++; // Increment the number of clicks 
         this->_lastTimestamp = timestamp; // Save this timestamp
       }
     } else {
-      Log::logTrace("[%s] Pin %d back to starting level", this->name(), this->_pinNumber);
+      DeferredLog::logTrace("[%s] Pin %d back to starting level", this->name(), this->_pinNumber);
     }
     // Always keep this value
     this->_lastValue = currentValue;
@@ -105,7 +106,7 @@ void DigitalClickWatcherComponent::loop() {
     (this->_maxClicks > 0 && this->_clickCount >= this->_maxClicks) || // we reached the maximum number of clicks
     (this->_clickCount > 0 && timestamp > this->_lastTimestamp + this->_maxInterval) // We have clicks and the maximum click time was reached
   ) {
-    Log::logDebug("[%s] Detected %d click(s)", this->name(), this->_clickCount);
+    DeferredLog::logDebug("[%s] Detected %d click(s)", this->name(), this->_clickCount);
     // We're done! Notify client
     this->_onClickDetected(this->_clickCount);
     // Reset the click count for the next series
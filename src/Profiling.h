@@ -0,0 +1,74 @@
+#ifndef __PROFILING_H__
+#define __PROFILING_H__
+
+#include <Arduino.h>
+#include "Histogram.h"
+
+#if !defined(ESP8266) && !defined(ESP32)
+  #include <chrono>
+#endif
+
+// The number of buckets in a loop profile histogram. Ticks are CPU cycles on the device,
+// so 24 buckets go up to 2^22 cycles (26 ms at 160 MHz)
+#ifndef PROFILE_HISTOGRAM_BUCKETS
+  #define PROFILE_HISTOGRAM_BUCKETS 24
+#endif
+
+/***
+ * A cheap, high resolution clock for profiling: the CPU cycle counter on the device and
+ * std::chrono::steady_clock (in nanoseconds) elsewhere. Only differences of less than
+ * 2^32 ticks are meaningful, which is several seconds
+ */
+namespace ProfileClock {
+#if defined(ESP8266) || defined(ESP32)
+  inline uint32_t ticks() { return ESP.getCycleCount(); }
+  inline uint32_t ticksPerMicrosecond() { return ESP.getCpuFreqMHz(); }
+#else
+  inline uint32_t ticks() { return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+  inline uint32_t ticksPerMicrosecond() { return 1000; }
+#endif
+  // Convert ticks to microseconds
+  inline float microseconds(uint32_t ticks) { return (float)ticks / ticksPerMicrosecond(); }
+}
+
+/***
+ * Statistics of the time a loop takes, in ProfileClock ticks
+ */
+class LoopProfile {
+  private:
+    uint32_t _count;
+    uint64_t _totalTicks;
+    uint32_t _minTicks;
+    uint32_t _maxTicks;
+    Histogram<PROFILE_HISTOGRAM_BUCKETS> _histogram;
+
+  public:
+    LoopProfile() { this->clear(); }
+
+    void clear() {
+      this->_count = 0;
+      this->_totalTicks = 0;
+      this->_minTicks = UINT32_MAX;
+      this->_maxTicks = 0;
+      this->_histogram.clear();
+    }
+
+    void add(uint32_t ticks) {
+      this->_count++;
+      this->_totalTicks += ticks;
+      if (ticks < this->_minTicks)
+        this->_minTicks = ticks;
+      if (ticks > this->_maxTicks)
+        this->_maxTicks = ticks;
+      this->_histogram.add(ticks);
+    }
+
+    uint32_t count() const { return this->_count; }
+    uint64_t totalTicks() const { return this->_totalTicks; }
+    uint32_t minTicks() const { return this->_count == 0 ? 0 : this->_minTicks; }
+    uint32_t maxTicks() const { return this->_maxTicks; }
+    uint32_t meanTicks() const { return this->_count == 0 ? 0 : (uint32_t)(this->_totalTicks / this->_count); }
+    // Approximate percentile, e.g. 99 for p99
+    uint32_t percentileTicks(uint8_t percent) const { return this->_histogram.percentile(percent, this->_maxTicks); }
+};
+#endif
@@ -0,0 +1,134 @@
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+/**
+ * A ring buffer of variable-length records in a fixed block of memory, for one producer and one consumer.
+ *
+ * A record is a 16-bit length followed by its bytes, and may wrap around the end of the memory. The
+ * buffer is bounded by bytes, not records, and is allocated once. Its capacity is rounded down to a power
+ * of two, so positions stay continuous when the byte counters wrap around. Neither side takes a lock: the producer
+ * only moves the head, the consumer only moves the tail, except that with DropOldest the producer moves
+ * the tail to make room. The consumer therefore copies a record out first and only then claims it; if the
+ * producer dropped it in the meantime, the claim fails and the copy is discarded
+ */
+class RingBuffer {
+  public:
+    // What push() does when a record doesn't fit: drop the oldest records to make room, or drop the new one
+    enum OverflowPolicy { DropOldest, DropNewest };
+
+  private:
+    uint8_t *_data;
+    uint32_t _capacity;
+    OverflowPolicy _policy;
+    // The number of bytes ever written and ever read. Their difference is the number of bytes in use
+    std::atomic<uint32_t> _head;
+    std::atomic<uint32_t> _tail;
+    std::atomic<uint32_t> _dropped;
+
+    void copyIn(uint32_t position, const void *source, size_t size) {
+      uint32_t offset = position & (this->_capacity - 1);
+      size_t first = size < this->_capacity - offset ? size : this->_capacity - offset;
+      memcpy(this->_data + offset, source, first);
+      memcpy(this->_data, (const uint8_t *)source + first, size - first);
+    }
+
+    void copyOut(uint32_t position, void *destination, size_t size) const {
+      uint32_t offset = position & (this->_capacity - 1);
+      size_t first = size < this->_capacity - offset ? size : this->_capacity - offset;
+      memcpy(destination, this->_data + offset, first);
+      memcpy((uint8_t *)destination + first, this->_data, size - first);
+    }
+
+    uint16_t lengthAt(uint32_t position) const {
+      uint16_t length;
+      this->copyOut(position, &length, sizeof(length));
+      return length;
+    }
+
+  public:
+    // The largest power of two not above [size] (and at least 16)
+    static uint32_t capacityFor(size_t size) {
+      uint32_t capacity = 16;
+      while (capacity <= size / 2 && capacity < 0x40000000)
+        capacity *= 2;
+      return capacity;
+    }
+
+    RingBuffer(size_t capacity, OverflowPolicy policy = DropOldest) :
+      _data(new uint8_t[capacityFor(capacity)]),
+      _capacity(capacityFor(capacity)),
+      _policy(policy),
+      _head(0),
+      _tail(0),
+      _dropped(0)
+    {}
+    ~RingBuffer() { delete[] this->_data; }
+
+    RingBuffer(const RingBuffer &) = delete;
+    RingBuffer &operator=(const RingBuffer &) = delete;
+
+    // Producer: add a record. Returns false if it was dropped
+    bool push(const void *record, size_t size) {
+      uint32_t needed = sizeof(uint16_t) + size;
+      if (size > UINT16_MAX || needed > this->_capacity) {
+        this->_dropped++;
+        return false;
+      }
+
+      uint32_t head = this->_head.load(std::memory_order_relaxed);
+      uint32_t tail = this->_tail.load(std::memory_order_acquire);
+      while (this->_capacity - (head - tail) < needed) {
+        if (this->_policy == DropNewest) {
+          this->_dropped++;
+          return false;
+        }
+        // Drop the oldest record, unless the consumer just took it
+        if (this->_tail.compare_exchange_weak(tail, tail + sizeof(uint16_t) + this->lengthAt(tail), std::memory_order_acq_rel))
+          this->_dropped++;
+        tail = this->_tail.load(std::memory_order_acquire);
+      }
+
+      uint16_t length = size;
+      this->copyIn(head, &length, sizeof(length));
+      this->copyIn(head + sizeof(length), record, size);
+      this->_head.store(head + needed, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer: take the oldest record, copied to [buffer] and 0-terminated. Records longer than [size] - 1
+    // are cut off. Returns the length copied, or -1 if the buffer is empty
+    int pop(char *buffer, size_t size) {
+      for (;;) {
+        uint32_t tail = this->_tail.load(std::memory_order_acquire);
+        if (tail == this->_head.load(std::memory_order_acquire))
+          return -1;
+        uint16_t length = this->lengthAt(tail);
+        size_t copied = length < size - 1 ? length : size - 1;
+        this->copyOut(tail + sizeof(length), buffer, copied);
+        if (this->_tail.compare_exchange_strong(tail, tail + sizeof(length) + length, std::memory_order_acq_rel)) {
+          buffer[copied] = 0;
+          return copied;
+        }
+        // The producer dropped the record while we copied it: try the next one
+      }
+    }
+
+    bool isEmpty() const { return this->_tail.load(std::memory_order_acquire) == this->_head.load(std::memory_order_acquire); }
+    // The number of bytes in use, including the record lengths. The tail is read first, so it's never past the head
+    size_t used() const {
+      uint32_t tail = this->_tail.load(std::memory_order_acquire);
+      return this->_head.load(std::memory_order_acquire) - tail;
+    }
+    size_t capacity() const { return this->_capacity; }
+    // The number of records dropped because they didn't fit
+    uint32_t dropped() const { return this->_dropped.load(std::memory_order_relaxed); }
+
+    OverflowPolicy policy() const { return this->_policy; }
+    void setPolicy(OverflowPolicy policy) { this->_policy = policy; }
+};
+#endif
@@ -1,4 +1,5 @@
 #include "RotaryEncoderWatcherComponent.h"
+#include "DeferredLog.h"
 
 RotaryEncoderWatcherComponent::RotaryEncoderWatcherComponent(uint8_t pinNumber, uint8_t pinNumber2, RotaryEncoder::LatchMode latchMode, std::function<void(int, int)> const onValueChanged, const char *name) :
   PinWatcherComponent(name == NULL ? "RotaryEncoder" : name, pinNumber, onValueChanged),
@@ -16,7 +17,7 @@ void RotaryEncoderWatcherComponent::loop() {
   this->_encoder.tick();
   int currentValue = this->_encoder.getPosition();
   if (currentValue != this->_lastValue) {
-    Log::logDebug("[%s] Position is now %d", this->name(), currentValue);
+    DeferredLog::logDebug("[%s] Position is now %d", this->name(), currentValue);
     this->_onValueChanged(this->_lastValue, currentValue);
     this->_lastValue = currentValue;
   }
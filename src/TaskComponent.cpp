@@ -1,43 +1,370 @@
 #include "TaskComponent.h"
 #include "logging.h"
 
-// Create a new task with a name, an interval in milliseconds and a function to call
-// when the task should run
-Task::Task(String name, Milliseconds interval, std::function<void()> const taskFunction) :
-  _name(name),
-  _interval(interval),
-  _nextRunTime(0), // ASAP
-  _taskFunction(taskFunction)
+// The schedule index of a task that is not in the schedule
+#define NOT_SCHEDULED ((size_t)-1)
+
+// Create an unused task. Tasks::add() puts it to use
+Task::Task() :
+  _name(),
+  _interval(0),
+  _nextRunTime(0),
+  _mode(FixedDelay),
+  _maxBurst(1),
+  _isInUse(false),
+  _isOneShot(false),
+  _isPaused(false),
+  _isCancelled(false),
+  _isCoroutine(false),
+  _isFinished(false),
+  _resumePoint(0),
+  _resumeDelay(0),
+  _sliceEnd(0),
+  _slot(0),
+  _generation(1),
+  _scheduleIndex(NOT_SCHEDULED),
+  _scheduleSequence(0),
+  _lastLateness(0),
+  _maxLateness(0),
+  _skippedRuns(0),
+  _sliceOverruns(0),
+  _runCount(0),
+  _totalRunTimeUs(0),
+  _minRunTimeUs(ULONG_MAX),
+  _maxRunTimeUs(0)
 {}
 
-// Run the task if it should, i.e. when the interval has passed since the last time the
-// task was run
-void Task::runIfRequired(Milliseconds currentMilliseconds)
+// Put a task to use with a name, an interval in milliseconds and a mode. The task
+// function is set by Tasks::add(). The task runs for the first time as soon as possible
+void Task::reset(const char *name, Milliseconds interval, TaskMode mode, uint8_t maxBurst)
+{
+  strlcpy(this->_name, name == NULL ? "" : name, sizeof(this->_name));
+  this->_interval = interval;
+  this->_nextRunTime = Deadline::now(); // ASAP
+  this->_mode = mode;
+  this->_maxBurst = maxBurst == 0 ? 1 : maxBurst;
+  this->_isInUse = true;
+  this->_isOneShot = false;
+  this->_isPaused = false;
+  this->_isCancelled = false;
+  this->_isCoroutine = false;
+  this->_isFinished = false;
+  this->_resumePoint = 0;
+  this->_resumeDelay = 0;
+  this->_scheduleIndex = NOT_SCHEDULED;
+  this->_lastLateness = 0;
+  this->_maxLateness = 0;
+  this->_skippedRuns = 0;
+  this->_sliceOverruns = 0;
+  this->_runCount = 0;
+  this->_totalRunTimeUs = 0;
+  this->_minRunTimeUs = ULONG_MAX;
+  this->_maxRunTimeUs = 0;
+#if TASK_HISTOGRAMS
+  this->_runTimeHistogram.clear();
+  this->_latenessHistogram.clear();
+#endif
+}
+
+// Determine the next run time after a run that started at currentMilliseconds
+void Task::scheduleNextRun(Timestamp currentMilliseconds)
 {
-  if (currentMilliseconds >= this->_nextRunTime)
+  if (this->_isCoroutine) {
+    // The coroutine told us when it wants to continue
+    this->_nextRunTime = Deadline::in(this->_resumeDelay);
+    return;
+  }
+
+  if (this->_mode == FixedDelay || this->_interval == 0) {
+    // Simply wait [interval] ms after this run
+    this->_nextRunTime = Deadline(currentMilliseconds) + this->_interval;
+    return;
+  }
+
+  // FixedRate: the next run is one interval after the previous *scheduled* run
+  this->_nextRunTime = this->_nextRunTime + this->_interval;
+
+  // If we're still behind, the next run is due immediately. Catch up with at most
+  // maxBurst runs and skip the rest, staying on the grid
+  long behind = this->_nextRunTime.elapsed(currentMilliseconds);
+  if (behind >= 0) {
+    unsigned long pendingRuns = (unsigned long)behind / this->_interval + 1;
+    if (pendingRuns > this->_maxBurst) {
+      unsigned long skip = pendingRuns - this->_maxBurst;
+      this->_nextRunTime = this->_nextRunTime + skip * this->_interval;
+      this->_skippedRuns += skip;
+      Log::logDebug("[%s] Behind by %ld ms, skipping %lu run(s)", this->_name, behind, skip);
+    }
+  }
+}
+
+// Run the task and record how late it started, how long it took and whether it kept to its time budget
+void Task::run(Timestamp currentMilliseconds, unsigned long sliceBudgetUs)
+{
+  this->_lastLateness = this->_nextRunTime.elapsed(currentMilliseconds);
+  if (this->_lastLateness > this->_maxLateness)
+    this->_maxLateness = this->_lastLateness;
+#if TASK_HISTOGRAMS
+  this->_latenessHistogram.add(this->_lastLateness);
+#endif
+
+  if (!this->_taskFunction.isEmpty())
   {
-    if (this->_taskFunction != NULL)
-    {
-      Log::logTrace("[%s] Running...", this->_name.c_str());
-      this->_taskFunction();
-      this->_nextRunTime = currentMilliseconds + this->_interval;
+    Log::logTrace("[%s] Running (%lu ms late)...", this->_name, this->_lastLateness);
+    Microseconds start = Clock::micros64();
+    // Without a budget, the slice never ends
+    this->_sliceEnd = sliceBudgetUs == 0 ? UINT64_MAX : start + sliceBudgetUs;
+    this->_taskFunction(*this);
+    unsigned long duration = (unsigned long)(Clock::micros64() - start);
+
+    this->_runCount++;
+    this->_totalRunTimeUs += duration;
+    if (duration < this->_minRunTimeUs)
+      this->_minRunTimeUs = duration;
+    if (duration > this->_maxRunTimeUs)
+      this->_maxRunTimeUs = duration;
+#if TASK_HISTOGRAMS
+    this->_runTimeHistogram.add(duration);
+#endif
+
+    if (sliceBudgetUs != 0 && duration > sliceBudgetUs) {
+      this->_sliceOverruns++;
+      Log::logDebug("[%s] Run took %lu us, budget is %lu us", this->_name, duration, sliceBudgetUs);
     }
   }
 }
 
+// All statistics of the task as "key=value;" pairs. Times are in us, lateness in ms
+String Task::statistics()
+{
+  char buffer[200];
+#if TASK_HISTOGRAMS
+  snprintf(buffer, sizeof(buffer),
+    "runs=%lu;mean=%lu;min=%lu;max=%lu;p50=%lu;p99=%lu;late=%lu;maxlate=%lu;p99late=%lu;overruns=%lu;skipped=%lu;",
+    this->_runCount, this->meanRunTimeUs(), this->minRunTimeUs(), this->_maxRunTimeUs,
+    (unsigned long)this->_runTimeHistogram.percentile(50, this->_maxRunTimeUs),
+    (unsigned long)this->_runTimeHistogram.percentile(99, this->_maxRunTimeUs),
+    this->_lastLateness, this->_maxLateness,
+    (unsigned long)this->_latenessHistogram.percentile(99, this->_maxLateness),
+    this->_sliceOverruns, this->_skippedRuns);
+#else
+  snprintf(buffer, sizeof(buffer),
+    "runs=%lu;mean=%lu;min=%lu;max=%lu;late=%lu;maxlate=%lu;overruns=%lu;skipped=%lu;",
+    this->_runCount, this->meanRunTimeUs(), this->minRunTimeUs(), this->_maxRunTimeUs,
+    this->_lastLateness, this->_maxLateness,
+    this->_sliceOverruns, this->_skippedRuns);
+#endif
+  return String(buffer);
+}
+
 // Tasks constructor
-Tasks::Tasks() : Component("Tasks")
-{}
+Tasks::Tasks() :
+  Component("Tasks"),
+  _freeCount(TASKS_MAX_COUNT),
+  _scheduleSize(0),
+  _scheduleSequence(0),
+  _currentTask(NULL),
+  _sliceBudgetUs(TASK_SLICE_BUDGET_US)
+{
+  // All slots are free. Hand out the lowest slots first
+  for (uint16_t slot = 0; slot < TASKS_MAX_COUNT; slot++) {
+    this->_tasks[slot]._slot = slot;
+    this->_freeSlots[slot] = TASKS_MAX_COUNT - 1 - slot;
+  }
+}
+
+// Is the task at schedule position a due before the task at position b?
+// Tasks that are due at the same time run in the order they were scheduled
+bool Tasks::isEarlier(size_t a, size_t b)
+{
+  Task *taskA = this->_schedule[a];
+  Task *taskB = this->_schedule[b];
+  if (taskA->_nextRunTime != taskB->_nextRunTime)
+    return taskA->_nextRunTime.isBefore(taskB->_nextRunTime);
+  return taskA->_scheduleSequence < taskB->_scheduleSequence;
+}
+
+// Swap two tasks in the schedule, keeping their schedule indexes up to date
+void Tasks::swap(size_t a, size_t b)
+{
+  Task *task = this->_schedule[a];
+  this->_schedule[a] = this->_schedule[b];
+  this->_schedule[b] = task;
+  this->_schedule[a]->_scheduleIndex = a;
+  this->_schedule[b]->_scheduleIndex = b;
+}
+
+// Move a task towards the front of the schedule until its parent is not later
+void Tasks::siftUp(size_t index)
+{
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (!this->isEarlier(index, parent))
+      break;
+    this->swap(index, parent);
+    index = parent;
+  }
+}
+
+// Move a task towards the back of the schedule until none of its children is earlier
+void Tasks::siftDown(size_t index)
+{
+  size_t size = this->_scheduleSize;
+  for (;;) {
+    size_t earliest = index;
+    size_t left = 2 * index + 1;
+    size_t right = left + 1;
+    if (left < size && this->isEarlier(left, earliest))
+      earliest = left;
+    if (right < size && this->isEarlier(right, earliest))
+      earliest = right;
+    if (earliest == index)
+      break;
+    this->swap(index, earliest);
+    index = earliest;
+  }
+}
+
+// Put a task in the schedule at its next run time. The task may be due before the
+// time this component sleeps until, so wake it up: loop() determines how long to sleep
+void Tasks::schedule(Task *task)
+{
+  task->_scheduleIndex = this->_scheduleSize++;
+  task->_scheduleSequence = ++this->_scheduleSequence;
+  this->_schedule[task->_scheduleIndex] = task;
+  this->siftUp(task->_scheduleIndex);
+  this->wake();
+}
+
+// Take a task out of the schedule. The last task takes its place, then moves to where it belongs
+void Tasks::unschedule(Task *task)
+{
+  size_t index = task->_scheduleIndex;
+  if (index == NOT_SCHEDULED)
+    return;
+
+  size_t last = --this->_scheduleSize;
+  if (index != last)
+    this->swap(index, last);
+  task->_scheduleIndex = NOT_SCHEDULED;
+
+  if (index != last) {
+    this->siftUp(index);
+    this->siftDown(index);
+  }
+}
+
+// Take a free task and put it to use. Returns NULL if all tasks are in use
+Task *Tasks::allocate(const char *name, Milliseconds interval, TaskMode mode, uint8_t maxBurst)
+{
+  if (this->_freeCount == 0) {
+    Log::logError("[%s] Cannot add task '%s': all %d tasks are in use", this->name(), name, TASKS_MAX_COUNT);
+    return NULL;
+  }
+  Task *task = &this->_tasks[this->_freeSlots[--this->_freeCount]];
+  task->reset(name, interval, mode, maxBurst);
+  return task;
+}
+
+// Schedule a task that was just allocated. Return its handle
+TaskHandle Tasks::store(Task *task)
+{
+  this->schedule(task);
+  return TaskHandle(task->_slot, task->_generation);
+}
+
+// Remove a task that is not in the schedule, freeing its slot
+void Tasks::destroy(Task *task)
+{
+  task->_taskFunction.clear();
+  task->_isInUse = false;
+  // Invalidate all handles to this task. Generation 0 is never used
+  if (++task->_generation == 0)
+    task->_generation = 1;
+  this->_freeSlots[this->_freeCount++] = task->_slot;
+}
+
+// Get the task for a handle, if it's still there
+Task *Tasks::get(TaskHandle handle)
+{
+  if (!handle.isSet() || handle.slot >= TASKS_MAX_COUNT)
+    return NULL;
+  Task *task = &this->_tasks[handle.slot];
+  if (task->_generation != handle.generation || !task->_isInUse || task->_isCancelled)
+    return NULL;
+  return task;
+}
+
+// Cancel a task. A running task is removed after it finishes
+bool Tasks::cancel(TaskHandle handle)
+{
+  Task *task = this->get(handle);
+  if (task == NULL)
+    return false;
+
+  Log::logTrace("[%s] Cancelling task '%s'", name(), task->name());
+  if (task == this->_currentTask) {
+    task->_isCancelled = true;
+  } else {
+    this->unschedule(task);
+    this->destroy(task);
+  }
+  return true;
+}
 
-// Add a task. Return the tasks index
-int Tasks::add(String name, Milliseconds interval, std::function<void()> const taskFunction)
+// Pause a task: take it out of the schedule
+bool Tasks::pause(TaskHandle handle)
 {
-  // Create a task with the parameters
-  Task *newTask = new Task(name, interval, taskFunction);
-  // Store it in the task list
-  this->tasks.push_back(newTask);
-  // Return task index
-  return this->tasks.size() - 1;
+  Task *task = this->get(handle);
+  if (task == NULL)
+    return false;
+
+  task->_isPaused = true;
+  this->unschedule(task);
+  return true;
+}
+
+// Resume a paused task, one interval from now
+bool Tasks::resume(TaskHandle handle)
+{
+  Task *task = this->get(handle);
+  if (task == NULL || !task->_isPaused)
+    return false;
+
+  task->_isPaused = false;
+  task->_nextRunTime = Deadline::in(task->_interval);
+  // A running task is rescheduled when it finishes
+  if (task != this->_currentTask)
+    this->schedule(task);
+  return true;
+}
+
+// Change the interval of a task
+bool Tasks::setInterval(TaskHandle handle, Milliseconds interval)
+{
+  Task *task = this->get(handle);
+  if (task == NULL)
+    return false;
+
+  // Move the next run relative to the previous one. A running task uses the
+  // new interval when it is rescheduled after it finishes
+  if (task != this->_currentTask)
+    task->_nextRunTime = Deadline(task->_nextRunTime.time - task->_interval) + interval;
+  task->_interval = interval;
+
+  if (task->_scheduleIndex != NOT_SCHEDULED) {
+    this->unschedule(task);
+    this->schedule(task);
+  }
+  return true;
+}
+
+// The time the first task is due
+Deadline Tasks::nextDeadline()
+{
+  if (this->_scheduleSize == 0)
+    return Deadline::in(NoDeadline);
+  return this->_schedule[0]->_nextRunTime;
 }
 
 // The setup() function is required by the Component base class
@@ -47,10 +374,37 @@ void Tasks::setup()
   Log::logTrace("[%s] Setting up Tasks", name());
 }
 
-// The loop() function from Component. Asks each task to run if it should
+// The loop() function from Component. Runs the tasks that are due, earliest first.
+// A task runs at most once per loop(), so a task with interval 0 runs on every loop
+// but cannot keep the loop busy forever. Afterwards, the component sleeps until the next task is due
 void Tasks::loop()
 {
-  Milliseconds currentMilliseconds = millis();
-  for (auto task: tasks)
-    task->runIfRequired(currentMilliseconds);
+  Timestamp currentMilliseconds = Clock::millis64();
+  uint64_t loopSequence = this->_scheduleSequence;
+  while (this->_scheduleSize > 0) {
+    Task *task = this->_schedule[0];
+    // Stop at the first task that is not due, or that was already run in this loop
+    if (task->_scheduleSequence > loopSequence || !task->_nextRunTime.hasPassed(currentMilliseconds))
+      break;
+
+    // Take the task out of the schedule while it runs, so it can cancel, pause or
+    // reschedule itself (or other tasks)
+    this->unschedule(task);
+    this->_currentTask = task;
+    task->run(currentMilliseconds, this->_sliceBudgetUs);
+    this->_currentTask = NULL;
+
+    if (task->_isCancelled || task->_isOneShot || task->_isFinished) {
+      this->destroy(task);
+    } else if (!task->_isPaused) {
+      task->scheduleNextRun(currentMilliseconds);
+      this->schedule(task);
+    }
+  }
+
+  // Don't loop again until the first task is due
+  if (this->_scheduleSize == 0)
+    this->sleep();
+  else
+    this->sleepUntil(this->nextDeadline());
 }
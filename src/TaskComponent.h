@@ -2,50 +2,345 @@
 #define __TASK_COMPONENT_H__
 
 #include <Arduino.h>
-#include <vector>
+#include <limits.h>
 
 #include "components.h"
+#include "Deadline.h"
+#include "InlineFunction.h"
+#include "Histogram.h"
 
-typedef unsigned long Milliseconds;
+// The maximum number of tasks. Storage for all of them is reserved up front, in the Tasks
+// component: roughly 150 bytes per task on the device, and 136 more with TASK_HISTOGRAMS.
+// Add -D TASKS_MAX_COUNT=xxx to build_flags in platformio.ini to change this. A #define in your own code
+// is not enough: the library is compiled separately and must see the same value
+#ifndef TASKS_MAX_COUNT
+  #define TASKS_MAX_COUNT 16
+#endif
+
+// The number of bytes a task function (e.g. a lambda with its captures) may occupy
+#ifndef TASK_FUNCTION_SIZE
+  #define TASK_FUNCTION_SIZE 32
+#endif
+
+// Task names are copied into the task, cut off at this size (including the terminating zero)
+#ifndef TASK_NAME_SIZE
+  #define TASK_NAME_SIZE 24
+#endif
+
+// The default number of runs a FixedRate task that fell behind may run back to back to catch up
+#ifndef TASK_MAX_BURST
+  #define TASK_MAX_BURST 3
+#endif
+
+// The default time budget of a single run ("slice") of a task in microseconds. 0 is unlimited
+#ifndef TASK_SLICE_BUDGET_US
+  #define TASK_SLICE_BUDGET_US 10000
+#endif
+
+// Add -D TASK_HISTOGRAMS=1 to keep run time (us) and lateness (ms) histograms of every task, for
+// percentiles. They take 136 bytes per task, so they are off by default
+#ifndef TASK_HISTOGRAMS
+  #define TASK_HISTOGRAMS 0
+#endif
+
+// The number of buckets in the histograms. The last bucket starts at 2^(buckets-2), so 16
+// buckets go up to 16 ms/16 s
+#ifndef TASK_HISTOGRAM_BUCKETS
+  #define TASK_HISTOGRAM_BUCKETS 16
+#endif
+
+class Task;
+
+#if TASK_HISTOGRAMS
+typedef Histogram<TASK_HISTOGRAM_BUCKETS> TaskHistogram;
+#endif
+
+typedef InlineFunction<void(Task &), TASK_FUNCTION_SIZE> TaskFunction;
+
+/***
+ * Macros for resumable tasks ("coroutines"), see Tasks::addCoroutine(). A coroutine is a
+ * task function that can give control back to the loop halfway and continue where it left
+ * off on a later loop:
+ *
+ *  _app.addCoroutine("Read sensor", [](Task &task) {
+ *    TASK_BEGIN(task);
+ *    digitalWrite(SENSOR_POWER, HIGH);
+ *    TASK_DELAY(task, 500);                  // Let the sensor settle, but keep looping
+ *    TASK_AWAIT(task, sensorIsReady());      // Resume when the condition is true
+ *    readSensor();
+ *    TASK_END(task);
+ *  });
+ *
+ * Local variables do NOT survive a TASK_DELAY/YIELD/AWAIT. Keep state in the lambda's
+ * captures (make the lambda mutable) or in static variables. Do not use switch statements
+ * around these macros, they are implemented using one
+ */
+// Start of the coroutine body
+#define TASK_BEGIN(task) switch ((task).resumePoint()) { case 0:
+// Continue on the next loop
+#define TASK_YIELD(task) TASK_DELAY(task, 0)
+// Continue after [ms] milliseconds
+#define TASK_DELAY(task, ms) do { (task).suspend(__LINE__, (ms)); return; case __LINE__:; } while (0)
+// Continue as soon as [condition] is true. The condition is checked on every loop
+#define TASK_AWAIT(task, condition) do { (task).suspend(__LINE__, 0); case __LINE__: if (!(condition)) return; } while (0)
+// Continue on the next loop if this run of the task has used up its time budget
+#define TASK_YIELD_IF_SLICE_EXPIRED(task) do { if ((task).sliceExpired()) TASK_YIELD(task); } while (0)
+// End of the coroutine body. The task is removed
+#define TASK_END(task) } (task).finish()
+
+/***
+ * How a task's next run time is determined after it runs
+ */
+enum TaskMode {
+  // The next run is [interval] ms after this run started. A late run delays all following runs
+  FixedDelay,
+  // Runs stay on a fixed grid of [interval] ms from the time the task was added. Late runs are
+  // caught up with, but never more than [maxBurst] back to back; other missed runs are skipped
+  FixedRate
+};
+
+/***
+ * A handle to a task added to a Tasks component. A handle stays safe to use after its task
+ * was cancelled or finished: it simply doesn't refer to a task anymore
+ */
+struct TaskHandle {
+  uint16_t slot;
+  uint16_t generation;
+
+  TaskHandle() : slot(0), generation(0) {}
+  TaskHandle(uint16_t slot, uint16_t generation) : slot(slot), generation(generation) {}
+
+  // Was this handle ever assigned a task? (It may be finished or cancelled by now)
+  bool isSet() const { return this->generation != 0; }
+};
 
 /***
  * A Task object is a named function that should run every [interval] milliseconds
- * Running Task objects is done by the Tasks component
+ * Running Task objects is done by the Tasks component, which owns a fixed number of them
 */
 class Task
 {
   private:
-    String _name;
+    // A copy of the name, so it may come from a String
+    char _name[TASK_NAME_SIZE];
     Milliseconds _interval;
-    Milliseconds _nextRunTime;
-    std::function<void()> const _taskFunction;
+    Deadline _nextRunTime;
+    TaskFunction _taskFunction;
+    TaskMode _mode;
+    uint8_t _maxBurst;
+    // Is this task in use? Unused tasks are available to Tasks::add()
+    bool _isInUse;
+    // A one-shot task is removed after it runs
+    bool _isOneShot;
+    // A paused task is not in the schedule
+    bool _isPaused;
+    // A cancelled task is removed as soon as it stops running
+    bool _isCancelled;
+    // A coroutine decides itself when it runs next. It is removed when it finishes
+    bool _isCoroutine;
+    bool _isFinished;
+    // Where a coroutine continues, and after how many ms
+    uint16_t _resumePoint;
+    Milliseconds _resumeDelay;
+    // When the current run of the task should end (in Clock::micros64())
+    Microseconds _sliceEnd;
+    // The slot of this task in the Tasks component, and the generation of that slot.
+    // The generation is incremented every time the task is removed
+    uint16_t _slot;
+    uint16_t _generation;
+    // The position of this task in the schedule of the Tasks component
+    size_t _scheduleIndex;
+    // When this task was last (re)scheduled. Orders tasks with the same next run time
+    uint64_t _scheduleSequence;
+
+    // Lateness statistics
+    Milliseconds _lastLateness;
+    Milliseconds _maxLateness;
+    unsigned long _skippedRuns;
+    // The number of runs that took longer than their slice budget
+    unsigned long _sliceOverruns;
+    // Run time statistics, in microseconds
+    unsigned long _runCount;
+    uint64_t _totalRunTimeUs;
+    unsigned long _minRunTimeUs;
+    unsigned long _maxRunTimeUs;
+#if TASK_HISTOGRAMS
+    TaskHistogram _runTimeHistogram;
+    TaskHistogram _latenessHistogram;
+#endif
+
+    void reset(const char *name, Milliseconds interval, TaskMode mode, uint8_t maxBurst);
+    void run(Timestamp currentMilliseconds, unsigned long sliceBudgetUs);
+    void scheduleNextRun(Timestamp currentMilliseconds);
 
   public:
-    // Constructor with a task name, interval and function
-    // If the task function returns true, it continues to run
-    Task(String name, Milliseconds interval, std::function<void()> const taskFunction);
+    // Constructor for an unused task
+    Task();
+
+    const char *name() { return this->_name; }
+    Milliseconds interval() { return this->_interval; }
+    TaskMode mode() { return this->_mode; }
+    // The number of runs a FixedRate task may run back to back to catch up (at least 1)
+    uint8_t maxBurst() { return this->_maxBurst; }
+    void setMaxBurst(uint8_t maxBurst) { this->_maxBurst = maxBurst == 0 ? 1 : maxBurst; }
+    bool isOneShot() { return this->_isOneShot; }
+    bool isPaused() { return this->_isPaused; }
+    // The time this task should run next
+    Deadline nextRunTime() { return this->_nextRunTime; }
 
-    // Run the task if it should
-    void runIfRequired(Milliseconds currentMilliseconds);
+    // How late the last run started, in ms after it was due
+    Milliseconds lastLateness() { return this->_lastLateness; }
+    // The maximum lateness seen so far
+    Milliseconds maxLateness() { return this->_maxLateness; }
+    // The number of runs skipped because a FixedRate task fell behind more than maxBurst runs
+    unsigned long skippedRuns() { return this->_skippedRuns; }
+    // The number of runs that took longer than the slice budget
+    unsigned long sliceOverruns() { return this->_sliceOverruns; }
+
+    // The number of times the task ran, and how long that took in microseconds
+    unsigned long runCount() { return this->_runCount; }
+    uint64_t totalRunTimeUs() { return this->_totalRunTimeUs; }
+    unsigned long minRunTimeUs() { return this->_runCount == 0 ? 0 : this->_minRunTimeUs; }
+    unsigned long maxRunTimeUs() { return this->_maxRunTimeUs; }
+    unsigned long meanRunTimeUs() { return this->_runCount == 0 ? 0 : (unsigned long)(this->_totalRunTimeUs / this->_runCount); }
+#if TASK_HISTOGRAMS
+    // The distribution of run times (us) and start lateness (ms)
+    const TaskHistogram &runTimeHistogram() { return this->_runTimeHistogram; }
+    const TaskHistogram &latenessHistogram() { return this->_latenessHistogram; }
+#endif
+    // All statistics on a single line: "runs=...;mean=...;...". Percentiles only with TASK_HISTOGRAMS
+    String statistics();
+
+    // Has the current run used up its time budget? Always false without a budget
+    bool sliceExpired() { return Clock::micros64() >= this->_sliceEnd; }
+
+    // Used by the TASK_xxx coroutine macros
+    uint16_t resumePoint() { return this->_resumePoint; }
+    void suspend(uint16_t resumePoint, Milliseconds delay) { this->_resumePoint = resumePoint; this->_resumeDelay = delay; }
+    void finish() { this->_isFinished = true; }
+
+    friend class Tasks;
 };
 
 /***
  * The Tasks component manages a list of Task objects
- * and runs them if in order. There should normally be a single Tasks object
+ * and runs them when they are due. There should normally be a single Tasks object
+ *
+ * Tasks are kept in a schedule (a binary min-heap) ordered by their next run time,
+ * so a loop() in which no task is due only has to look at the first task. Paused and
+ * cancelled tasks are taken out of the schedule
  */
 class Tasks: public Component {
   private:
-    // The list of tasks
-    std::vector<Task *> tasks;
+    // All tasks by slot, and the slots that are free
+    Task _tasks[TASKS_MAX_COUNT];
+    uint16_t _freeSlots[TASKS_MAX_COUNT];
+    size_t _freeCount;
+
+    // The schedule: a min-heap of tasks, ordered by next run time
+    Task *_schedule[TASKS_MAX_COUNT];
+    size_t _scheduleSize;
+    // Incremented every time a task is (re)scheduled
+    uint64_t _scheduleSequence;
+    // The task that is running, if any
+    Task *_currentTask;
+    // The time budget of a single task run in microseconds
+    unsigned long _sliceBudgetUs;
+
+    bool isEarlier(size_t a, size_t b);
+    void swap(size_t a, size_t b);
+    void siftUp(size_t index);
+    void siftDown(size_t index);
+    void schedule(Task *task);
+    void unschedule(Task *task);
+
+    Task *allocate(const char *name, Milliseconds interval, TaskMode mode, uint8_t maxBurst = TASK_MAX_BURST);
+    TaskHandle store(Task *task);
+    void destroy(Task *task);
 
   public:
+    // The number of milliseconds from now nextDeadline() returns when there are no tasks
+    static const Milliseconds NoDeadline = Deadline::MaxDelay;
+
     Tasks();
 
-    // Add a task to the list
-    int add(String name, Milliseconds interval, std::function<void()> const taskFunction);
+    // Add a task that runs every [interval] ms, starting as soon as possible. A FixedRate task that
+    // fell behind runs at most [maxBurst] times back to back (TASK_MAX_BURST, 3 by default)
+    // The task function is stored inside the task, so it must fit in TASK_FUNCTION_SIZE bytes
+    // Returns an unset handle if there is no room for another task
+    template<typename F> TaskHandle add(const char *name, Milliseconds interval, F taskFunction, TaskMode mode = FixedDelay, uint8_t maxBurst = TASK_MAX_BURST) {
+      Task *task = this->allocate(name, interval, mode, maxBurst);
+      if (task == NULL)
+        return TaskHandle();
+      task->_taskFunction = [taskFunction](Task &) mutable { taskFunction(); };
+      return this->store(task);
+    }
+    template<typename F> TaskHandle add(const String &name, Milliseconds interval, F taskFunction, TaskMode mode = FixedDelay, uint8_t maxBurst = TASK_MAX_BURST) {
+      return this->add(name.c_str(), interval, taskFunction, mode, maxBurst);
+    }
+
+    // Add a one-shot task that runs once, [timeout] ms from now
+    template<typename F> TaskHandle addTimeout(const char *name, Milliseconds timeout, F taskFunction) {
+      Task *task = this->allocate(name, timeout, FixedDelay);
+      if (task == NULL)
+        return TaskHandle();
+      task->_taskFunction = [taskFunction](Task &) mutable { taskFunction(); };
+      task->_isOneShot = true;
+      task->_nextRunTime = Deadline::in(timeout);
+      return this->store(task);
+    }
+    template<typename F> TaskHandle addTimeout(const String &name, Milliseconds timeout, F taskFunction) {
+      return this->addTimeout(name.c_str(), timeout, taskFunction);
+    }
+
+    // Add a resumable task (a "coroutine") that starts as soon as possible. The function
+    // receives its Task and uses the TASK_xxx macros to continue on later loops
+    template<typename F> TaskHandle addCoroutine(const char *name, F coroutineFunction) {
+      Task *task = this->allocate(name, 0, FixedDelay);
+      if (task == NULL)
+        return TaskHandle();
+      task->_taskFunction = coroutineFunction;
+      task->_isCoroutine = true;
+      return this->store(task);
+    }
+    template<typename F> TaskHandle addCoroutine(const String &name, F coroutineFunction) {
+      return this->addCoroutine(name.c_str(), coroutineFunction);
+    }
+
+    // Get the task for a handle. NULL if the task was cancelled or has finished
+    Task *get(TaskHandle handle);
+    // Is the task for this handle still around (running, scheduled or paused)?
+    bool isActive(TaskHandle handle) { return this->get(handle) != NULL; }
+
+    // Remove a task. Can be called from within the task itself
+    bool cancel(TaskHandle handle);
+    // Take a task out of the schedule until it is resumed
+    bool pause(TaskHandle handle);
+    // Put a paused task back in the schedule. Its next run is one interval from now
+    bool resume(TaskHandle handle);
+    // Change the interval of a task. The next run is rescheduled to one (new) interval after the previous run
+    bool setInterval(TaskHandle handle, Milliseconds interval);
+
+    // The number of tasks, including paused ones
+    size_t count() { return TASKS_MAX_COUNT - this->_freeCount; }
+    // Call [f] with every task (a Task *), including paused ones
+    template<typename F> void forEach(F f) {
+      for (size_t slot = 0; slot < TASKS_MAX_COUNT; slot++)
+        if (this->_tasks[slot]._isInUse)
+          f(&this->_tasks[slot]);
+    }
+    // The time the first task is due. Without tasks, this is NoDeadline ms from now
+    Deadline nextDeadline();
+    // The task that is currently running, e.g. to get its lastLateness(). NULL outside of a task
+    Task *current() { return this->_currentTask; }
+
+    // The time budget of a single task run in microseconds, 0 for none. Runs that take longer are
+    // counted as overruns; coroutines can check Task::sliceExpired() to give up control in time
+    void setSliceBudget(unsigned long microseconds) { this->_sliceBudgetUs = microseconds; }
+    unsigned long sliceBudget() { return this->_sliceBudgetUs; }
 
     // Component implementations
     void setup();
     void loop();
 };
-#endif
\ No newline at end of file
+#endif
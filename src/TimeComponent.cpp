@@ -1,38 +1,234 @@
 #include "TimeComponent.h"
+#include <LittleFS.h>
 
-TimeComponent::TimeComponent(const char *timezoneName, uint16_t syncTimeout) :
+// Seconds between 1900 (NTP) and 1970 (Unix)
+#define NTP_UNIX_OFFSET 2208988800UL
+#define NTP_PACKET_SIZE 48
+
+TimeComponent::TimeComponent(const char *timezoneName, uint16_t syncTimeout, const char *ntpServer, unsigned long ntpIntervalSeconds, const char *posixTimezone) :
 	Component("Time"),
 	_timezoneName(timezoneName),
-  _syncTimeout(syncTimeout)
-{}
+  _posixTimezone(posixTimezone == NULL ? "" : posixTimezone),
+  _syncTimeout(syncTimeout),
+  _ntpServer(ntpServer == NULL ? "" : ntpServer),
+  _ntpPort(123),
+  _ntpIntervalMs(ntpIntervalSeconds * 1000UL),
+  _isResolved(false),
+  _missedReplies(0),
+  _state(Synchronizing),
+  _syncStartTime(0),
+  _hasSyncTimedOut(false),
+  _needsLookup(false),
+  _isWaitingForReply(false),
+  _requestTime(0),
+  _syncs(0),
+  _failures(0),
+  _lastRoundTripMs(0)
+{
+  // host:port, e.g. for a local NTP server when testing
+  int colon = this->_ntpServer.indexOf(':');
+  if (colon >= 0) {
+    this->_ntpPort = atoi(this->_ntpServer.c_str() + colon + 1);
+    this->_ntpServer = this->_ntpServer.substring(0, colon);
+  }
+  this->needs(NetworkCapability);
+  this->provides(TimeCapability);
+}
 
 Timezone *TimeComponent::TZ()
 {
 	return &this->_TZ;
 }
 
-// Set up the internal Timezone object
+// Set up the internal Timezone object without the network, from the configured or cached
+// POSIX TZ string. This is called when the network is available, which NTP needs.
+// Synchronization continues from loop()
 void TimeComponent::setup()
 {
   setStatus(100, Log::LOGLEVEL::Information, "Starting");
-  this->_TZ.setLocation(this->_timezoneName);
-  this->_TZ.setDefault();
-	Log::logDebug("[%s] Waiting for synchronization (%d s)...", name(), this->_syncTimeout);
-  // Wait for time synchronization. If this fails, report it but continue
-  if (!waitForSync(this->_syncTimeout)) {
-    setStatus(900, Log::LOGLEVEL::Information, "Failed to synchronize");
-    Log::logTrace("[%s] Failed to synchronize time", name());
+  this->setReady(false);
+
+  String posix;
+  if (!this->_posixTimezone.isEmpty()) {
+    this->_TZ.setPosix(this->_posixTimezone);
+  } else if (this->readCachedTimezone(posix)) {
+    Log::logDebug("[%s] Time zone '%s' from cache: %s", name(), this->_timezoneName.c_str(), posix.c_str());
+    this->_TZ.setPosix(posix);
   } else {
-    setStatus(300, Log::LOGLEVEL::Information, "Initialized");
-    Log::logDebug("[%s] Time in time zone '%s' is '%s'", name(), this->_timezoneName.c_str(), this->_TZ.dateTime().c_str());
+    this->_needsLookup = true;
   }
-
-  // Notify the logging system we have time
+  this->_TZ.setDefault();
+  // Notify the logging system we have a time zone
   Log::setTimezone(&this->_TZ);
+
+  // We do NTP ourselves, so eztime's events() never blocks for it
+  setInterval(0);
+  this->_udp.begin(TIME_NTP_LOCAL_PORT);
+
+	Log::logDebug("[%s] Waiting for synchronization with %s:%u (%d s)...", name(), this->_ntpServer.c_str(), this->_ntpPort, this->_syncTimeout);
+  this->_state = Synchronizing;
+  this->_syncStartTime = Deadline::now();
+  this->_nextRequestTime = Deadline::now();
+}
+
+// Look up the address of the NTP server. An IP address needs no lookup; a host name does, which
+// blocks, so this is only done for the first request and when the server stops answering
+bool TimeComponent::resolveServer()
+{
+  if (this->_ntpAddress.fromString(this->_ntpServer.c_str()) || WiFi.hostByName(this->_ntpServer.c_str(), this->_ntpAddress) == 1) {
+    LOG_DEBUG("[%s] NTP server %s is %s", name(), this->_ntpServer.c_str(), this->_ntpAddress.toString().c_str());
+    this->_isResolved = true;
+    this->_missedReplies = 0;
+    return true;
+  }
+  Log::logDebug("[%s] Cannot resolve NTP server '%s'", name(), this->_ntpServer.c_str());
+  return false;
+}
+
+// Send an NTP request. The transmit timestamp is a cookie the server echoes, so we can tell
+// its reply from stale or spoofed ones
+bool TimeComponent::sendRequest()
+{
+  uint8_t packet[NTP_PACKET_SIZE];
+  memset(packet, 0, sizeof(packet));
+  // Leap indicator 0, version 4, mode 3 (client)
+  packet[0] = 0x23;
+  uint32_t micro = micros(), milli = millis();
+  memcpy(this->_cookie, &micro, 4);
+  memcpy(this->_cookie + 4, &milli, 4);
+  memcpy(packet + 40, this->_cookie, 8);
+
+  // Drop replies to earlier requests
+  while (this->_udp.parsePacket() > 0)
+    ;
+
+  if (!this->_udp.beginPacket(this->_ntpAddress, this->_ntpPort))
+    return false;
+  this->_udp.write(packet, sizeof(packet));
+  if (!this->_udp.endPacket())
+    return false;
+
+  this->_isWaitingForReply = true;
+  this->_requestTime = Clock::micros64();
+  return true;
+}
+
+// Check for the reply to our request. If it's there, set the time
+bool TimeComponent::receiveReply()
+{
+  int size = this->_udp.parsePacket();
+  if (size <= 0)
+    return false;
+
+  uint8_t packet[NTP_PACKET_SIZE];
+  if (size < NTP_PACKET_SIZE || this->_udp.read(packet, sizeof(packet)) != NTP_PACKET_SIZE)
+    return false;
+  // Mode 4 (server), not a "kiss of death" (stratum 0), and an answer to our request
+  if ((packet[0] & 0x07) != 4 || packet[1] == 0 || memcmp(packet + 24, this->_cookie, 8) != 0)
+    return false;
+
+  Microseconds now = Clock::micros64();
+  unsigned long roundTripUs = (unsigned long)(now - this->_requestTime);
+  unsigned long roundTripMs = roundTripUs / 1000;
+  uint32_t seconds = (uint32_t)packet[40] << 24 | (uint32_t)packet[41] << 16 | (uint32_t)packet[42] << 8 | packet[43];
+  uint32_t fraction = (uint32_t)packet[44] << 24 | (uint32_t)packet[45] << 16 | (uint32_t)packet[46] << 8 | packet[47];
+  // The server sent its time about halfway the round trip
+  int64_t utc = (int64_t)(seconds - NTP_UNIX_OFFSET) * 1000000LL + (int64_t)(((uint64_t)fraction * 1000000) >> 32) + roundTripUs / 2;
+  Clock::synchronize(utc, now);
+  UTC.setTime((time_t)(utc / 1000000), (uint16_t)(utc / 1000 % 1000));
+
+  this->_isWaitingForReply = false;
+  this->_missedReplies = 0;
+  this->_lastRoundTripMs = roundTripMs;
+  this->_syncs++;
+  LOG_DEBUG("[%s] Synchronized with %s in %lu ms (%s)", name(), this->_ntpServer.c_str(), roundTripMs, Clock::statistics().c_str());
+  return true;
+}
+
+// Look up the time zone rules by name, which needs the network and blocks, and cache them
+void TimeComponent::lookupTimezone()
+{
+  if (!this->_TZ.setLocation(this->_timezoneName)) {
+    Log::logWarning("[%s] Cannot look up time zone '%s', retrying later", name(), this->_timezoneName.c_str());
+    return;
+  }
+  this->_needsLookup = false;
+  String posix = this->_TZ.getPosix();
+  Log::logInformation("[%s] Time zone '%s' is %s", name(), this->_timezoneName.c_str(), posix.c_str());
+  this->writeCachedTimezone(posix);
+}
+
+// The cache has the time zone name on the first line and the POSIX TZ string on the second
+bool TimeComponent::readCachedTimezone(String &posix)
+{
+  File file = LittleFS.open(TIME_TZ_CACHE_FILE, "r");
+  if (!file)
+    return false;
+  String name = file.readStringUntil('\n');
+  posix = file.readStringUntil('\n');
+  file.close();
+  name.trim();
+  posix.trim();
+  return name == this->_timezoneName && !posix.isEmpty();
+}
+
+void TimeComponent::writeCachedTimezone(const String &posix)
+{
+  File file = LittleFS.open(TIME_TZ_CACHE_FILE, "w");
+  if (!file) {
+    Log::logWarning("[%s] Could not write %s", name(), TIME_TZ_CACHE_FILE);
+    return;
+  }
+  file.print(this->_timezoneName + "\n" + posix + "\n");
+  file.close();
 }
 
-// Call eztime's events()
+// Request the time from the NTP server every interval, without waiting for the reply, and
+// call eztime's events()
 void TimeComponent::loop()
 {
   events();
+
+  if (this->_isWaitingForReply) {
+    if (this->receiveReply()) {
+      this->_nextRequestTime = Deadline::in(this->_ntpIntervalMs);
+      if (this->_state == Synchronizing) {
+        setStatus(300, Log::LOGLEVEL::Information, "Initialized");
+        LOG_DEBUG("[%s] Time in time zone '%s' is '%s'", name(), this->_timezoneName.c_str(), this->_TZ.dateTime().c_str());
+        this->_state = Synchronized;
+        this->setReady(true);
+      }
+      // Without cached rules, look them up now that we have the time. If that fails, we try
+      // again after the next synchronization
+      if (this->_needsLookup)
+        this->lookupTimezone();
+    } else if (Clock::micros64() - this->_requestTime > TIME_NTP_TIMEOUT_MS * 1000ULL) {
+      Log::logTrace("[%s] No reply from %s", name(), this->_ntpServer.c_str());
+      this->_isWaitingForReply = false;
+      this->_failures++;
+      this->_nextRequestTime = Deadline::in(TIME_NTP_RETRY_MS);
+      // The server may have moved (pool.ntp.org does)
+      if (++this->_missedReplies >= TIME_NTP_RESOLVE_AFTER)
+        this->_isResolved = false;
+    }
+  }
+
+  if (!this->_isWaitingForReply && this->_nextRequestTime.hasPassed()) {
+    if (!this->_isResolved && !this->resolveServer()) {
+      this->_failures++;
+      this->_nextRequestTime = Deadline::in(TIME_NTP_RESOLVE_RETRY_MS);
+    } else if (!this->sendRequest()) {
+      this->_failures++;
+      this->_nextRequestTime = Deadline::in(TIME_NTP_RETRY_MS);
+    }
+  }
+
+  // If synchronizing takes too long, report it but keep trying
+  if (this->_state == Synchronizing && this->_syncTimeout != 0 && !this->_hasSyncTimedOut && (this->_syncStartTime + this->_syncTimeout * 1000UL).hasPassed()) {
+    setStatus(900, Log::LOGLEVEL::Information, "Failed to synchronize");
+    Log::logTrace("[%s] Failed to synchronize time", name());
+    this->_hasSyncTimedOut = true;
+  }
+
+  this->sleepFor(this->_isWaitingForReply ? 10 : 100);
 }
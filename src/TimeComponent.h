@@ -3,25 +3,104 @@
 
 #include <Arduino.h>
 #include <eztime.h>
+#include <WiFiUdp.h>
+#include "Specific_ESP_Wifi.h"
 #include "components.h"
 #include "logging.h"
 
+// Where the POSIX TZ string of the time zone is cached, so looking it up is only needed once
+#ifndef TIME_TZ_CACHE_FILE
+  #define TIME_TZ_CACHE_FILE "/tz.cache"
+#endif
+
+// How long to wait for an NTP reply (ms), and how long to wait before retrying after a failure (ms)
+#ifndef TIME_NTP_TIMEOUT_MS
+  #define TIME_NTP_TIMEOUT_MS 1500
+#endif
+#ifndef TIME_NTP_RETRY_MS
+  #define TIME_NTP_RETRY_MS 2000
+#endif
+
+// Resolving the NTP server blocks, so its address is kept. It is resolved again after this many
+// requests in a row without a reply, and a failed lookup is retried after a while (ms)
+#ifndef TIME_NTP_RESOLVE_AFTER
+  #define TIME_NTP_RESOLVE_AFTER 3
+#endif
+#ifndef TIME_NTP_RESOLVE_RETRY_MS
+  #define TIME_NTP_RESOLVE_RETRY_MS 30000
+#endif
+
+// The local UDP port for NTP
+#ifndef TIME_NTP_LOCAL_PORT
+  #define TIME_NTP_LOCAL_PORT 2390
+#endif
+
 /***
  * Component-version of eztime
+ *
+ * The component needs a network, so it is set up when WiFi is connected. Synchronizing
+ * happens from loop(), so it doesn't hold up the other components. The component is ready
+ * (and provides the time) when the time is set
+ *
+ * NTP is done here rather than by eztime, whose requests block until the reply arrives. The server
+ * name is resolved once and kept, not for every request. The time zone rules come from a POSIX TZ
+ * string if configured, or else from the cache. Only when there is neither are they looked up
+ * (once, after synchronizing), which does block
  */
 class TimeComponent: public Component
 {
   private:
     String _timezoneName;
+    String _posixTimezone;
     Timezone _TZ;
     uint16_t _syncTimeout;
 
+    // The NTP server and port, and the interval between synchronizations (ms)
+    String _ntpServer;
+    uint16_t _ntpPort;
+    unsigned long _ntpIntervalMs;
+    // The address of the NTP server, if resolved, and the number of requests in a row without a reply
+    IPAddress _ntpAddress;
+    bool _isResolved;
+    uint8_t _missedReplies;
+
+    // Where synchronization is at
+    enum { Synchronizing, Synchronized } _state;
+    Deadline _syncStartTime;
+    bool _hasSyncTimedOut;
+    // Does the time zone still have to be looked up?
+    bool _needsLookup;
+
+    // The NTP request we're waiting for a reply to, if any: when it was sent and what the reply must echo
+    WiFiUDP _udp;
+    bool _isWaitingForReply;
+    Microseconds _requestTime;
+    uint8_t _cookie[8];
+    Deadline _nextRequestTime;
+    // Statistics
+    unsigned long _syncs;
+    unsigned long _failures;
+    unsigned long _lastRoundTripMs;
+
+    bool resolveServer();
+    bool sendRequest();
+    bool receiveReply();
+    void lookupTimezone();
+    bool readCachedTimezone(String &posix);
+    void writeCachedTimezone(const String &posix);
+
   public:
-    // Constructor with a time zone name, e.g. Europe/Amsterdam
-    TimeComponent(const char *timezoneName, uint16_t syncTimeout = 0);
+    // Constructor with a time zone name, e.g. Europe/Amsterdam, or a POSIX TZ string, e.g.
+    // CET-1CEST,M3.5.0,M10.5.0/3, which takes precedence. The NTP server can be host or host:port
+    TimeComponent(const char *timezoneName, uint16_t syncTimeout = 0, const char *ntpServer = "pool.ntp.org", unsigned long ntpIntervalSeconds = 1800, const char *posixTimezone = NULL);
     // A pointer to the interal timezone object
     Timezone *TZ();
 
+    // Successful and failed NTP requests, and the round trip time of the last one (ms)
+    unsigned long syncs() { return this->_syncs; }
+    unsigned long failures() { return this->_failures; }
+    unsigned long lastRoundTripMs() { return this->_lastRoundTripMs; }
+
     // Required by Component
     void setup();
     void loop();
@@ -37,5 +37,7 @@ void U8DisplayComponent::setup() {
   Log::logDebug("U8Display initialized.");
 }
 
+// Nothing to do in the loop: sleep until woken
 void U8DisplayComponent::loop() {
+  this->sleep();
 }
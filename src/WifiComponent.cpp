@@ -2,12 +2,37 @@
 #include "logging.h"
 
 #include "Specific_ESP_Wifi.h"
+#include <LittleFS.h>
+#include <stddef.h>
 
 WiFiClient WifiComponent::_wifiClient;
 
+#define WIFI_CACHE_MAGIC 0x57464331
+
+#if defined(ESP32)
+// Survives ESP.restart(), but not a power cycle
+RTC_NOINIT_ATTR static WifiConnectionCache rtcCache;
+#endif
+
+// FNV-1a
+static uint32_t hash(const uint8_t *data, size_t size, uint32_t hash = 2166136261UL) {
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ data[i]) * 16777619UL;
+  return hash;
+}
+
+static uint32_t ssidHash(const String &ssid) {
+  return hash((const uint8_t *)ssid.c_str(), ssid.length());
+}
+
+static uint32_t checksum(const WifiConnectionCache &cache) {
+  return hash((const uint8_t *)&cache + offsetof(WifiConnectionCache, ssidHash), sizeof(cache) - offsetof(WifiConnectionCache, ssidHash));
+}
+
 // Helper function to restart after a delay
 void Restart() {
   delay(2000);
+  Log::flush();
   ESP.restart();
 }
 
@@ -32,16 +57,87 @@ WifiComponent::WifiComponent(
 ) :
   Component("Wifi"),
   _hostname(hostname),
-  _ssid(ssid),
-  _password(password),
+  _networkCount(0),
+  _network(-1),
   _intervalMs(checkInterval),
   _waitMs(waitTime),
   _lastCheckTime(0),
   _watchdogTimeoutSeconds(watchdogTimeoutSeconds),
   _ap_ssid(ap_ssid),
   _ap_password(ap_password),
-  _fallbackOnly(!ap_permanent)
+  _fallbackOnly(!ap_permanent),
+  _haveSoftAP(false),
+  _state(WifiOff),
+  _stateTime(0),
+  _isReconnecting(false),
+  _disconnectTime(0),
+  _backoffMs(WIFI_RECONNECT_BACKOFF_MS),
+  _attempts(0),
+  _totalAttempts(0),
+  _failedAttempts(0),
+  _reconnects(0),
+  _lastReconnectMs(0),
+  _maxReconnectMs(0),
+  _setupTime(0),
+  _connectTime(0),
+  _accessPoint(-1),
+  _isKnownAccessPointAttempt(false),
+  _fastConnect(true),
+  _reuseIpAddress(false),
+  _haveCache(false),
+  _isUsingCachedIp(false),
+  _bootToIpMs(0),
+  _wasFastConnect(false),
+  _roamThreshold(0),
+  _roamHysteresis(8),
+  _roamSampleMs(10000),
+  _nextRoamSampleTime(0),
+  _lastRoamScanTime(0),
+  _averageRssi(0),
+  _isRoaming(false),
+  _roamScans(0),
+  _roams(0),
+  _lastRoamMs(0)
 {
+  for (int state = 0; state < WIFI_STATE_COUNT; state++)
+    this->_stateMs[state] = 0;
+  for (int a = 0; a < WIFI_ACCESS_POINT_CACHE_SIZE; a++)
+    this->_accessPoints[a].isUsed = false;
+  if (ssid != NULL && *ssid != 0)
+    this->addNetwork(ssid, password);
+  this->provides(NetworkCapability);
+}
+
+// Add a network to connect to. Returns false if there are too many
+bool WifiComponent::addNetwork(const char *ssid, const char *password)
+{
+  if (this->_networkCount >= WIFI_MAX_NETWORKS) {
+    Log::logError("[%s] Cannot add network '%s': at most %d networks", this->name(), ssid, WIFI_MAX_NETWORKS);
+    return false;
+  }
+  WifiNetwork &network = this->_networks[this->_networkCount++];
+  network.ssid = ssid;
+  network.password = password == NULL ? "" : password;
+  network.connects = 0;
+  network.failures = 0;
+  network.connectMs = 0;
+  return true;
+}
+
+// Learn from a connection attempt. Halve the counts when they get large, so a network that
+// stops working (e.g. after moving the device) drops in the ranking soon enough
+void WifiNetwork::learn(bool success, uint32_t ms)
+{
+  if (success) {
+    this->connectMs = this->connects == 0 ? ms : (this->connectMs * 3 + ms) / 4;
+    this->connects++;
+  } else {
+    this->failures++;
+  }
+  if (this->connects + this->failures > 100) {
+    this->connects /= 2;
+    this->failures /= 2;
+  }
 }
 
 /**
@@ -56,7 +152,7 @@ bool WifiComponent::setupSoftAP() {
   Log::logInformation("[%s] Setting up soft AP with SSID '%s' and password '%s'", this->name(), this->_ap_ssid, this->_ap_password);
 
   // Switch to AP mode or even AP+STA
-  if (this->_fallbackOnly || this->_ssid.isEmpty())
+  if (this->_fallbackOnly || this->_networkCount == 0)
     // Fallback only, or no Station WiFi: AP only
     WiFi.mode(WIFI_AP);
   else
@@ -75,18 +171,21 @@ bool WifiComponent::setupSoftAP() {
 }
 
 /**
- * Try to connect to the WiFi network. Scans for the strongest BSSID. If none is found,
- * a soft AP is set up if configured. If not, the ESP is restarted.
- * 
- * If a suitable BSSID is found, a connection is attempted. If a watchdog timeout was
- * specified and it expires, a soft AP is set up if configured, else the ESPS is restarted.
+ * Configure WiFi and start connecting. Connecting continues from loop(), so setup() returns
+ * right away: the component is ready when it is connected.
+ *
+ * The access point of the last good connection is tried first, directly on its channel. If that
+ * doesn't work or there is none, a scan determines the best BSSID. If none is found, or if a
+ * watchdog timeout was specified and it expires, a soft AP is set up if configured. If not, the
+ * ESP is restarted.
  */
 void WifiComponent::setup()
 {
   // --- Configure WIFI ---
 
   // Do we have a WiFi network we want to connect to in "station mode"?
-  bool haveStationWifi = !this->_ssid.isEmpty();
+  bool haveStationWifi = this->_networkCount > 0;
+  this->_setupTime = Clock::millis64();
 
 #if defined(ESP32)
   // Make sure we connect to the strongest access point
@@ -101,195 +200,697 @@ void WifiComponent::setup()
   WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
 #endif
 
-  bool haveSoftAP = false;
+  this->_haveSoftAP = false;
 
   // Handle soft AP setup when _fallbackOnly == false (i.e. permanent soft AP)
   if (!this->_ap_ssid.isEmpty() && this->_fallbackOnly == false) {
     // We have a PERMANENT soft AP configured
     // WiFi.mode(WIFI_AP_STA);
     if (this->setupSoftAP())
-      haveSoftAP = true;
+      this->_haveSoftAP = true;
   } else {
     // Station only, no AP
     WiFi.mode(WIFI_STA);
   }
 
-  // Without station WiFi, we don't have a BSSID
-  String bssid = haveStationWifi ? this->connectToStrongest() : "";
+  this->setReady(false);
+  if (!haveStationWifi) {
+    // Without station WiFi, all we can have is a soft AP
+    this->fallBack("No SSID configured");
+    this->setState(WifiOff);
+    return;
+  }
+
+  this->loadRanking();
+  if (this->_fastConnect && this->loadConnectionCache()) {
+    setStatus(1000, Log::LOGLEVEL::Information, "Connecting");
+    this->connectToCached();
+    return;
+  }
+
+  // Look for the strongest access point. loop() picks up the results
+  setStatus(1000, Log::LOGLEVEL::Information, "Scanning");
+  this->startScan();
+}
+
+// Start an asynchronous scan for the configured SSID, or for all networks if there are several
+void WifiComponent::startScan()
+{
+  const char *ssid = this->_networkCount == 1 ? this->_networks[0].ssid.c_str() : NULL;
+  Log::logDebug("[%s] Starting WiFi-scan for SSID '%s'...", this->name(), ssid == NULL ? "*" : ssid);
+#ifdef ESP32
+  WiFi.scanNetworks(true, false, false, 300U, 0, ssid);
+#else
+  WiFi.scanNetworks(true, false, 0, (uint8*)ssid);
+#endif
+  this->setState(WifiScanning);
+}
 
+// Scanning: when the scan is done, connect to the strongest access point
+void WifiComponent::checkScan()
+{
+  int n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING) {
+    this->sleepFor(100);
+    return;
+  }
+
+  // While reconnecting, the WiFi stack may have reconnected by itself in the meantime
+  if (WiFi.status() == WL_CONNECTED) {
+    WiFi.scanDelete();
+    this->connected();
+    return;
+  }
+
+  // A failed scan found nothing
+  String bssid = this->connectToBest(n < 0 ? 0 : n);
   if (bssid.isEmpty()) {
+    this->attemptFailed("No networks found");
+    return;
+  }
 
-    // We were not able to find a network OR there was none configured. See if we need to set up a soft access point
-    if (!this->_ap_ssid.isEmpty()) {
-      // Skip setting ip a soft AP is we already have one
-      if (!haveSoftAP) {
-        // We have an AP SSID. Set it up:
-        Log::logWarning("[%s] No networks '%s' found, setting up soft AP...", this->name(), this->_ssid.c_str());
-        if (!this->setupSoftAP()) {
-          // Soft AP set up failed! Restart the ESP
-          Log::logCritical("[%s] No networks '%s' found, soft AP failed: giving up...", this->name(), this->_ssid.c_str());
-          Restart();
-        } else {
-          haveSoftAP = true;
-        }
-      }
-    } else {
-      // We have no soft AP configured. Restart the ESP
-      Log::logCritical("[%s] No networks '%s' found, no soft AP configured: giving up...", this->name(), this->_ssid.c_str());
-      Restart();
+  Log::logDebug("[%s] Connecting to WiFi network '%s' with timeout %d, interval %d, wait %d seconds...",
+    this->name(),
+    this->_networks[this->_network].ssid.c_str(),
+    this->_watchdogTimeoutSeconds,
+    this->_intervalMs / 1000,
+    this->_waitMs / 1000
+  );
+  setStatus(1000, Log::LOGLEVEL::Information, "Connecting");
+  this->setState(WifiConnecting);
+}
+
+// Connecting: wait for the connection until the watchdog (if any) expires or, when
+// reconnecting, until the wait time expires
+void WifiComponent::checkConnecting()
+{
+  if (WiFi.status() == WL_CONNECTED) {
+    this->connected();
+    return;
+  }
+
+  unsigned long ms = Clock::millis64() - this->_stateTime;
+  unsigned long timeoutMs = this->_isReconnecting ? this->_waitMs : this->_watchdogTimeoutSeconds * 1000UL;
+  // At boot, don't spend the whole watchdog on one network if there are others
+  bool isTryingNetworks = !this->_isReconnecting && this->_networkCount > 1 && this->_waitMs != 0;
+  if (isTryingNetworks && (timeoutMs == 0 || timeoutMs > this->_waitMs))
+    timeoutMs = this->_waitMs;
+  if (this->_isKnownAccessPointAttempt && (timeoutMs == 0 || timeoutMs > WIFI_KNOWN_ACCESS_POINT_TIMEOUT_MS))
+    timeoutMs = WIFI_KNOWN_ACCESS_POINT_TIMEOUT_MS;
+  if (timeoutMs != 0 && ms > timeoutMs) {
+    // Rank the access point lower next time
+    if (this->_accessPoint >= 0 && this->_accessPoints[this->_accessPoint].failures < 255)
+      this->_accessPoints[this->_accessPoint].failures++;
+    if (this->_network >= 0)
+      this->_networks[this->_network].learn(false, 0);
+    if (this->_isKnownAccessPointAttempt && !this->_isReconnecting) {
+      // The last good connection didn't work at boot: scan instead
+      Log::logWarning("[%s] No connection to the last access point after %lu ms, scanning...", this->name(), ms);
+      this->_isKnownAccessPointAttempt = false;
+      this->useDhcp();
+      this->startScan();
+      return;
+    }
+    this->_isKnownAccessPointAttempt = false;
+    if (isTryingNetworks && (this->_watchdogTimeoutSeconds == 0 || Clock::millis64() - this->_setupTime < this->_watchdogTimeoutSeconds * 1000UL)) {
+      // Another network may be better: scan again, the one that failed now ranks lower
+      Log::logWarning("[%s] No connection to '%s' after %lu ms, scanning...", this->name(), this->_networks[this->_network].ssid.c_str(), ms);
+      this->startScan();
+      return;
     }
+    // At boot, we have a watchdog set up - give up after it expires, either by setting up an AP or restarting
+    this->attemptFailed(("No connection after " + String(ms / 1000) + " seconds").c_str());
+    return;
+  }
 
+  // If there is no timeout, connection is retried indefinitely
+  Log::logTrace("[%s] Still connecting...", this->name());
+  setStatus(1000, Log::LOGLEVEL::Trace, ("Connecting " + String(1 + ms / 1000)).c_str());
+  this->sleepFor(500);
+}
+
+// We're connected, either for the first time or after reconnecting
+void WifiComponent::connected()
+{
+  setStatus(2000, Log::LOGLEVEL::Information, "Connected");
+  if (this->_isRoaming) {
+    this->_lastRoamMs = Clock::millis64() - this->_disconnectTime;
+    this->_roams++;
+    Log::logInformation("[%s] Roamed to %s (%d dBm) in %lu ms", this->name(), WiFi.BSSIDstr().c_str(), WiFi.RSSI(), this->_lastRoamMs);
+  } else if (this->_isReconnecting) {
+    unsigned long ms = Clock::millis64() - this->_disconnectTime;
+    this->_reconnects++;
+    this->_lastReconnectMs = ms;
+    if (ms > this->_maxReconnectMs)
+      this->_maxReconnectMs = ms;
+    Log::logWarning("[%s] Reconnected after %lu ms and %lu attempt(s) to %s (%d dBm).", this->name(), ms, this->_attempts, WiFi.localIP().toString().c_str(), WiFi.RSSI());
   } else {
+    Log::logInformation("[%s] Connected '%s' to '%s' (%s) at %s (MAC %s) in %lu ms", this->name(), WiFi.getHostname(), WiFi.SSID().c_str(), WiFi.BSSIDstr().c_str(), WiFi.localIP().toString().c_str(), WiFi.macAddress().c_str(), (unsigned long)(Clock::millis64() - this->_stateTime));
+  }
+  if (this->_bootToIpMs == 0) {
+    this->_bootToIpMs = (unsigned long)Clock::millis64();
+    this->_wasFastConnect = this->_isKnownAccessPointAttempt && !this->_isReconnecting;
+    Log::logInformation("[%s] IP address %lu ms after boot (%s)", this->name(), this->_bootToIpMs, this->_wasFastConnect ? "last good connection" : "scanned");
+  }
+  this->saveConnectionCache();
+  if (this->_accessPoint >= 0) {
+    this->_accessPoints[this->_accessPoint].failures = 0;
+    this->_accessPoints[this->_accessPoint].connects++;
+  }
+  // The WiFi stack may have connected by itself
+  if (this->_network < 0 || this->_networks[this->_network].ssid != WiFi.SSID())
+    this->_network = this->networkOf(WiFi.SSID());
+  if (this->_state == WifiConnecting && this->_network >= 0) {
+    this->_networks[this->_network].learn(true, Clock::millis64() - this->_connectTime);
+    this->saveRanking();
+  }
+  this->_isKnownAccessPointAttempt = false;
+  this->_isReconnecting = false;
+  this->_isRoaming = false;
+  this->setState(WifiConnected);
+  this->_lastCheckTime = Deadline::now();
+  this->_averageRssi = WiFi.RSSI();
+  this->_nextRoamSampleTime = Deadline::in(this->_roamSampleMs);
+  this->setReady(true);
+}
 
-    // We found a suitable BSSID. try connecting to it:
-    Log::logDebug("[%s] Connecting to WiFi network '%s' with timeout %d, interval %d, wait %d seconds...",
-      this->name(),
-      this->_ssid.c_str(),
-      this->_watchdogTimeoutSeconds,
-      this->_intervalMs / 1000,
-      this->_waitMs / 1000
-    );
-    setStatus(1000, Log::LOGLEVEL::Information, "Connecting");
-    unsigned long ms = millis();
-
-    while (WiFi.status() != WL_CONNECTED)
-    {
-      if (this->_watchdogTimeoutSeconds != 0 && millis() > ms + this->_watchdogTimeoutSeconds * 1000) {
-        // We have a watchdog set up - give up after it expires, either by setting up an AP or restarting
-        Serial.println();
-        
-        // If we have a soft AP configured, set it up now (unless already done)
-        if (!this->_ap_ssid.isEmpty()) {
-
-          if (haveSoftAP) {
-            // If we have a soft AP already, just warn
-            Log::logCritical("[%s] No connection after %d seconds, relying on soft AP '%s'", this->name(), this->_watchdogTimeoutSeconds, this->_ap_ssid);
-            break;
-          } else {
-            // Attempt a soft AP
-            setStatus(1010, Log::LOGLEVEL::Critical, this->_ap_ssid.c_str());
-            Log::logCritical("[%s] No connection after %d seconds, falling back to soft AP '%s'...", this->name(), this->_watchdogTimeoutSeconds, this->_ap_ssid);
-            if (!this->setupSoftAP()) {
-              setStatus(1010, Log::LOGLEVEL::Critical, "Giving up!");
-              Log::logCritical("[%s] Soft AP setup failed, restarting...", this->name());
-              Restart();
-            } else {
-              break;
-            }
-          }
-
-        } else {
-
-          // No soft AP configured, give up
-          setStatus(1010, Log::LOGLEVEL::Critical, "Giving up!");
-          Log::logCritical("[%s] No connection after %d seconds, restarting...", this->name(), this->_watchdogTimeoutSeconds);
-          Restart();
+// Connect to the access point of the last good connection, on its channel
+void WifiComponent::connectToCached()
+{
+  // Remember it as an access point, so failing to connect ranks it lower
+  WifiAccessPoint &accessPoint = this->_accessPoints[0];
+  accessPoint.isUsed = true;
+  accessPoint.network = this->_network;
+  memcpy(accessPoint.bssid, this->_cache.bssid, 6);
+  accessPoint.channel = this->_cache.channel;
+  accessPoint.rssi = this->_cache.rssi;
+  accessPoint.seenTime = Deadline::now();
+  accessPoint.isInLastScan = false;
+  accessPoint.failures = 0;
+  accessPoint.connects = 0;
+
+  // Skipping DHCP saves the most time, but the address may have been given to someone else meanwhile
+  if (this->_reuseIpAddress && this->_cache.ip != 0) {
+    Log::logInformation("[%s] Reusing IP address %s", this->name(), IPAddress(this->_cache.ip).toString().c_str());
+    WiFi.config(IPAddress(this->_cache.ip), IPAddress(this->_cache.gateway), IPAddress(this->_cache.subnet), IPAddress(this->_cache.dns));
+    this->_isUsingCachedIp = true;
+  }
 
-        }
-      }
+  this->connectTo(0);
+  this->_isKnownAccessPointAttempt = true;
+  this->setState(WifiConnecting);
+}
 
-      // If there is no watchdog timeout, connection is retried indefinitely
-      Log::logTrace("[%s] Still connecting...", this->name());
-      Serial.print(".");
-      setStatus(1000, Log::LOGLEVEL::Trace, ("Connecting " + String(1 + (millis() - ms) / 1000) /* + "/" + String(this->_watchdogTimeoutSeconds) */).c_str());
-      delay(500);
-    }
+// Stop using the IP configuration of the last good connection
+void WifiComponent::useDhcp()
+{
+  if (!this->_isUsingCachedIp)
+    return;
+  WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+  this->_isUsingCachedIp = false;
+}
+
+// Read the last good connection from RTC memory or, after a power cycle, from LittleFS
+bool WifiComponent::loadConnectionCache()
+{
+  const char *source = "RTC memory";
+#if defined(ESP32)
+  memcpy(&this->_cache, &rtcCache, sizeof(this->_cache));
+#else
+  ESP.rtcUserMemoryRead(WIFI_CACHE_RTC_OFFSET, (uint32_t *)&this->_cache, sizeof(this->_cache));
+#endif
+  if (this->_cache.magic != WIFI_CACHE_MAGIC || this->_cache.checksum != checksum(this->_cache) || this->networkOfHash(this->_cache.ssidHash) < 0) {
+    source = WIFI_CACHE_FILE;
+    File file = LittleFS.open(WIFI_CACHE_FILE, "r");
+    if (!file || file.read((uint8_t *)&this->_cache, sizeof(this->_cache)) != sizeof(this->_cache))
+      this->_cache.magic = 0;
+    if (file)
+      file.close();
+  }
+
+  this->_haveCache = this->_cache.magic == WIFI_CACHE_MAGIC && this->_cache.checksum == checksum(this->_cache) && this->networkOfHash(this->_cache.ssidHash) >= 0;
+  if (this->_haveCache) {
+    this->_network = this->networkOfHash(this->_cache.ssidHash);
+    LOG_DEBUG("[%s] Last good connection from %s: '%s' on channel %d, IP %s", this->name(), source, this->_networks[this->_network].ssid.c_str(), this->_cache.channel, IPAddress(this->_cache.ip).toString().c_str());
+  }
+  return this->_haveCache;
+}
+
+// Keep the current connection as the last good one. RTC memory is written every time, the
+// file only when the access point or the IP configuration changed, to spare the flash
+void WifiComponent::saveConnectionCache()
+{
+  WifiConnectionCache cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.magic = WIFI_CACHE_MAGIC;
+  cache.ssidHash = ssidHash(WiFi.SSID());
+  memcpy(cache.bssid, WiFi.BSSID(), 6);
+  cache.channel = WiFi.channel();
+  cache.ip = (uint32_t)WiFi.localIP();
+  cache.gateway = (uint32_t)WiFi.gatewayIP();
+  cache.subnet = (uint32_t)WiFi.subnetMask();
+  cache.dns = (uint32_t)WiFi.dnsIP(0);
+  // The same connection, apart from the signal strength?
+  bool isChanged = !this->_haveCache || memcmp(&cache.ssidHash, &this->_cache.ssidHash, offsetof(WifiConnectionCache, rssi) - offsetof(WifiConnectionCache, ssidHash)) != 0
+    || memcmp(&cache.ip, &this->_cache.ip, sizeof(cache) - offsetof(WifiConnectionCache, ip)) != 0;
+  cache.rssi = WiFi.RSSI();
+  cache.checksum = checksum(cache);
 
-    // A connection was made OR a soft AP was set up
-    Serial.println();
-    
-    if (WiFi.status() == WL_CONNECTED) {
-      setStatus(2000, Log::LOGLEVEL::Information, "Connected");
-      Log::logInformation("[%s] Connected '%s' to '%s' (%s) at %s (MAC %s)", this->name(), WiFi.getHostname(), WiFi.SSID().c_str(), WiFi.BSSIDstr().c_str(), WiFi.localIP().toString().c_str(), WiFi.macAddress().c_str());
+#if defined(ESP32)
+  memcpy(&rtcCache, &cache, sizeof(cache));
+#else
+  ESP.rtcUserMemoryWrite(WIFI_CACHE_RTC_OFFSET, (uint32_t *)&cache, sizeof(cache));
+#endif
+  if (isChanged) {
+    File file = LittleFS.open(WIFI_CACHE_FILE, "w");
+    if (!file || file.write((const uint8_t *)&cache, sizeof(cache)) != sizeof(cache))
+      Log::logWarning("[%s] Could not write %s", this->name(), WIFI_CACHE_FILE);
+    if (file)
+      file.close();
+  }
+  memcpy(&this->_cache, &cache, sizeof(cache));
+  this->_haveCache = true;
+}
+
+// The connection was lost: start reconnecting
+void WifiComponent::startReconnect()
+{
+  Log::logWarning("[%s] Disconnected! Reconnecting...", this->name());
+  this->setReady(false);
+  this->_isReconnecting = true;
+  this->_disconnectTime = Clock::millis64();
+  this->_attempts = 0;
+  this->_backoffMs = WIFI_RECONNECT_BACKOFF_MS;
+  this->startAttempt();
+}
+
+// Start a reconnect attempt. The first one goes straight to the best access point seen
+// recently; if that fails, or there is none, scan first
+void WifiComponent::startAttempt()
+{
+  this->_attempts++;
+  this->_totalAttempts++;
+
+  int known = this->_attempts == 1 ? this->bestAccessPoint(false) : -1;
+  if (known < 0) {
+    this->startScan();
+    return;
+  }
+  this->connectTo(known);
+  this->_isKnownAccessPointAttempt = true;
+  this->setState(WifiConnecting);
+}
+
+// Scanning or connecting failed. At boot, fall back to the soft AP. When reconnecting,
+// wait before the next attempt, twice as long every time up to the check interval
+void WifiComponent::attemptFailed(const char *reason)
+{
+  if (!this->_isReconnecting) {
+    this->fallBack(reason);
+    return;
+  }
+
+  // Switching access points failed: the connection is lost, carry on reconnecting
+  this->_isRoaming = false;
+  this->_failedAttempts++;
+  Log::logWarning("[%s] %s, *not* reconnected! Retrying in %lu ms", this->name(), reason, this->_backoffMs);
+  this->setState(WifiBackoff);
+  this->sleepFor(this->_backoffMs);
+  this->_backoffMs *= 2;
+  if (this->_backoffMs > this->_intervalMs)
+    this->_backoffMs = this->_intervalMs < WIFI_RECONNECT_BACKOFF_MS ? WIFI_RECONNECT_BACKOFF_MS : this->_intervalMs;
+}
+
+// Station WiFi is not available: rely on a soft AP, setting it up if necessary. Without one, restart
+void WifiComponent::fallBack(const char *reason)
+{
+  this->setState(WifiFailed);
+
+  if (this->_ap_ssid.isEmpty()) {
+    // No soft AP configured, give up
+    setStatus(1010, Log::LOGLEVEL::Critical, "Giving up!");
+    Log::logCritical("[%s] %s, no soft AP configured: restarting...", this->name(), reason);
+    Restart();
+  } else if (this->_haveSoftAP) {
+    // If we have a soft AP already, just warn
+    Log::logCritical("[%s] %s, relying on soft AP '%s'", this->name(), reason, this->_ap_ssid.c_str());
+  } else {
+    // Attempt a soft AP
+    setStatus(1010, Log::LOGLEVEL::Critical, this->_ap_ssid.c_str());
+    Log::logCritical("[%s] %s, falling back to soft AP '%s'...", this->name(), reason, this->_ap_ssid.c_str());
+    if (!this->setupSoftAP()) {
+      setStatus(1010, Log::LOGLEVEL::Critical, "Giving up!");
+      Log::logCritical("[%s] Soft AP setup failed, restarting...", this->name());
+      Restart();
     } else {
-      // We should have a soft AP here
-      setStatus(9000, Log::LOGLEVEL::Error, "NOT connected");
-      Log::logCritical("[%s] Cannot connect to WiFi", this->name());
+      this->_haveSoftAP = true;
     }
   }
 }
 
-// Check for a lost connection and reconnect, but only if the interval is not 0 AND we have station WiFi
+void WifiComponent::setState(WifiState state)
+{
+  Timestamp now = Clock::millis64();
+  this->_stateMs[this->_state] += now - this->_stateTime;
+  this->_state = state;
+  this->_stateTime = now;
+}
+
+// Connected: keep a running average of the RSSI. If it's too weak, look for a stronger
+// access point, but not too often
+void WifiComponent::sampleRssi()
+{
+  Timestamp now = Clock::millis64();
+  this->_nextRoamSampleTime = Deadline::in(this->_roamSampleMs);
+  int32_t rssi = WiFi.RSSI();
+  // Exponential moving average, so a single bad sample doesn't trigger a scan
+  this->_averageRssi += (rssi - this->_averageRssi) / 4;
+  Log::logTrace("[%s] RSSI %d dBm, average %d dBm", this->name(), rssi, this->_averageRssi);
+  if (this->_averageRssi >= this->_roamThreshold)
+    return;
+  if (this->_roamScans > 0 && now - this->_lastRoamScanTime < WIFI_ROAM_SCAN_INTERVAL_MS)
+    return;
+
+  Log::logDebug("[%s] Average RSSI %d dBm is below %d dBm, looking for a stronger access point", this->name(), this->_averageRssi, this->_roamThreshold);
+  this->_roamScans++;
+  this->_lastRoamScanTime = now;
+  this->startScan();
+  this->setState(WifiRoaming);
+}
+
+// Roaming: when the scan is done, switch to the best access point if it's enough stronger.
+// We stay connected (and ready) while scanning
+void WifiComponent::checkRoamScan()
+{
+  int n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING && Clock::millis64() - this->_stateTime < WIFI_ROAM_SCAN_TIMEOUT_MS) {
+    this->sleepFor(100);
+    return;
+  }
+  if (n < 0) {
+    Log::logDebug("[%s] Roaming scan failed or timed out", this->name());
+    n = 0;
+  }
+  this->updateAccessPoints(n);
+  WiFi.scanDelete();
+  this->setState(WifiConnected);
+
+  // The connection may have been lost meanwhile; the connection check takes care of that
+  // Stay on the same network; its access points are all the same to the rest of the ranking
+  int best = this->bestAccessPoint(true, this->_network);
+  int32_t rssi = WiFi.RSSI();
+  if (best < 0 || WiFi.status() != WL_CONNECTED || memcmp(this->_accessPoints[best].bssid, WiFi.BSSID(), 6) == 0 || this->_accessPoints[best].rssi < rssi + this->_roamHysteresis) {
+    Log::logDebug("[%s] Not roaming: no access point at least %d dB stronger than %d dBm", this->name(), this->_roamHysteresis, rssi);
+    return;
+  }
+
+  Log::logInformation("[%s] Roaming from %s (%d dBm)...", this->name(), WiFi.BSSIDstr().c_str(), rssi);
+  // Until connected, this is a reconnect: if it fails, we back off and scan again
+  this->setReady(false);
+  this->_isRoaming = true;
+  this->_isReconnecting = true;
+  this->_disconnectTime = Clock::millis64();
+  this->_attempts = 1;
+  this->_backoffMs = WIFI_RECONNECT_BACKOFF_MS;
+  this->connectTo(best);
+  this->setState(WifiConnecting);
+}
+
+// Continue (re)connecting, or check for a lost connection, but only if the interval is not 0 AND we have station WiFi
+// Every call does a bounded amount of work: nothing here waits for WiFi
 void WifiComponent::loop()
 {
-  // If we have no check interval OR no station WiFi, skip this check
-  if (this->_intervalMs == 0 || this->_ssid.isEmpty())
+  switch (this->_state) {
+    case WifiScanning:
+      this->checkScan();
+      return;
+    case WifiConnecting:
+      this->checkConnecting();
+      return;
+    case WifiRoaming:
+      this->checkRoamScan();
+      return;
+    case WifiBackoff:
+      // Done waiting. The WiFi stack may have reconnected by itself
+      if (WiFi.status() == WL_CONNECTED)
+        this->connected();
+      else
+        this->startAttempt();
+      return;
+    default:
+      break;
+  }
+
+  bool isRoamingEnabled = this->_roamThreshold != 0 && this->_state == WifiConnected;
+  if (isRoamingEnabled && this->_nextRoamSampleTime.hasPassed()) {
+    this->sampleRssi();
+    if (this->_state == WifiRoaming)
+      return;
+  }
+
+  // If we have no check interval OR no station WiFi, there is nothing to check
+  if (this->_intervalMs == 0 || this->_networkCount == 0) {
+    if (isRoamingEnabled)
+      this->sleepUntil(this->_nextRoamSampleTime);
+    else
+      this->sleep();
     return;
+  }
 
-  if (millis() > this->_lastCheckTime + this->_intervalMs) {
+  if ((this->_lastCheckTime + this->_intervalMs).hasPassed()) {
     Log::logDebug("[%s] Checking connection... (%d)", this->name(), WiFi.status());
 
     // if WiFi is down, try reconnecting
-    if (WiFi.status() != WL_CONNECTED)
-    {
-      Log::logWarning("[%s] Disconnected! Reconnecting...", this->name());
-
-      this->connectToStrongest();
-
-      // WiFi.reconnect(); // Includes a disconnect()
-      
-      // Wait for the reconnection:
-      unsigned int ms = 0;
-      do {
-        delay(1000);
-        ms += 1000;
-      } while (ms < this->_waitMs && WiFi.status() != WL_CONNECTED);
-
-      if (WiFi.status() == WL_CONNECTED) {
-        Log::logWarning("[%s] Reconnected after %d seconds to %s (%d dBm).", this->name(), ms / 1000, WiFi.localIP().toString().c_str(), WiFi.RSSI());
-      } else {
-        Log::logWarning("[%s] *Not* reconnected!", this->name());
-      }
-    } else {
-      Log::logDebug("[%s] Wifi connected to %s (%d dBm).", this->name(), WiFi.localIP().toString().c_str(), WiFi.RSSI());
+    if (WiFi.status() != WL_CONNECTED) {
+      this->startReconnect();
+      return;
+    }
 
-      // We have WiFi - if we have a non-permanent soft AP set up, DISCONNECT THAT HERE
-      if ((WiFi.getMode() & WIFI_AP) && this->_fallbackOnly) {
-        Log::logInformation("[%s] Disabling fallback-only soft AP", this->name());
-        WiFi.mode(WIFI_STA);
-      }
+    LOG_DEBUG("[%s] Wifi connected to %s (%d dBm).", this->name(), WiFi.localIP().toString().c_str(), WiFi.RSSI());
+    // We may have connected after all, e.g. after falling back to the soft AP
+    if (this->_state != WifiConnected) {
+      this->setState(WifiConnected);
+      this->setReady(true);
     }
 
-    this->_lastCheckTime = millis();
+    // We have WiFi - if we have a non-permanent soft AP set up, DISCONNECT THAT HERE
+    if ((WiFi.getMode() & WIFI_AP) && this->_fallbackOnly) {
+      Log::logInformation("[%s] Disabling fallback-only soft AP", this->name());
+      WiFi.mode(WIFI_STA);
+    }
+
+    this->_lastCheckTime = Deadline::now();
   }
+
+  // Sleep until the next check or RSSI sample
+  Deadline next = this->_lastCheckTime + this->_intervalMs;
+  if (isRoamingEnabled && this->_nextRoamSampleTime.isBefore(next))
+    next = this->_nextRoamSampleTime;
+  this->sleepUntil(next);
+}
+
+// Reconnect and boot statistics as "key=value;" pairs. Times are in ms
+String WifiComponent::statistics()
+{
+  char buffer[180];
+  snprintf(buffer, sizeof(buffer), "reconnects=%lu;attempts=%lu;failed=%lu;last=%lu;max=%lu;boot=%lu;fast=%d;roamscans=%lu;roams=%lu;lastroam=%lu;",
+    this->_reconnects, this->_totalAttempts, this->_failedAttempts, this->_lastReconnectMs, this->_maxReconnectMs, this->_bootToIpMs, this->_wasFastConnect ? 1 : 0,
+    this->_roamScans, this->_roams, this->_lastRoamMs);
+  return String(buffer);
+}
+
+// The time spent in each state so far as "state=seconds;" pairs, including the current one
+String WifiComponent::stateTimes()
+{
+  static const char *names[WIFI_STATE_COUNT] = { "off", "scanning", "connecting", "connected", "failed", "backoff", "roaming" };
+  String result;
+  char buffer[40];
+  for (int state = 0; state < WIFI_STATE_COUNT; state++) {
+    uint64_t ms = this->_stateMs[state] + (state == this->_state ? Clock::millis64() - this->_stateTime : 0);
+    snprintf(buffer, sizeof(buffer), "%s=%lu.%03lu;", names[state], (unsigned long)(ms / 1000), (unsigned long)(ms % 1000));
+    result += buffer;
+  }
+  return result;
 }
 
 /**
- * Perform a WiFi scan to determine the strongest BSSID for the configured SSID
+ * Perform a WiFi scan to determine the strongest BSSID for the configured SSID. This blocks
+ * for the duration of the scan; the component itself scans asynchronously
  * If a BSSID is found, try connecting to it and return it.
  * If no BSSID is found OR no SSID was configured, return ""
  */
 String WifiComponent::connectToStrongest() {
-  if (this->_ssid.isEmpty()) {
+  if (this->_networkCount == 0) {
     Log::logCritical("[%s] Cannot perform WiFi-scan, no SSID configured", this->name());
     return "";
   }
 
-  Log::logDebug("[%s] Starting WiFi-scan for SSID '%s'...", this->name(), this->_ssid.c_str());
+  const char *ssid = this->_networkCount == 1 ? this->_networks[0].ssid.c_str() : NULL;
+  Log::logDebug("[%s] Starting WiFi-scan for SSID '%s'...", this->name(), ssid == NULL ? "*" : ssid);
 #ifdef ESP32
-  int n = WiFi.scanNetworks(false, false, false, 300U, 0, this->_ssid.c_str());
+  int n = WiFi.scanNetworks(false, false, false, 300U, 0, ssid);
 #else
-  int n = WiFi.scanNetworks(false, false, 0, (uint8*)this->_ssid.c_str());
+  int n = WiFi.scanNetworks(false, false, 0, (uint8*)ssid);
 #endif
-  uint8_t *bssid = NULL;
+  return this->connectToBest(n);
+}
+
+/**
+ * Connect to the best of the [n] access points found by the last scan, and return its BSSID
+ * Returns "" if there are none. The scan results are deleted
+ */
+String WifiComponent::connectToBest(int n) {
+  this->updateAccessPoints(n);
+  WiFi.scanDelete();
 
-  if (n == 0) {
-    Log::logWarning("[%s] No networks with SSID '%s' found", this->name(), this->_ssid.c_str());
+  int best = this->bestAccessPoint(true);
+  if (best < 0) {
+    Log::logWarning("[%s] None of the %d configured networks found", this->name(), this->_networkCount);
     return "";
   }
+  this->connectTo(best);
+  return this->_accessPoints[best].bssidString();
+}
+
+// Remember the access points of our networks among the [n] results of the last scan
+void WifiComponent::updateAccessPoints(int n) {
+  for (int a = 0; a < WIFI_ACCESS_POINT_CACHE_SIZE; a++)
+    this->_accessPoints[a].isInLastScan = false;
 
-  int bestMatch = 0;
-  int bestRSSI = WiFi.RSSI(0);
+  Deadline now = Deadline::now();
   for (int i = 0; i < n; i++) {
-    // Look for a stronger BSSID
-    if (i > 0 && WiFi.RSSI(i) > bestRSSI) {
-      bestMatch = i;
-      bestRSSI = WiFi.RSSI(i);
+    LOG_DEBUG("[%s] %2d: %s (%d dBm) BSSID %s channel %d", this->name(), i + 1, WiFi.SSID(i).c_str(), WiFi.RSSI(i), WiFi.BSSIDstr(i).c_str(), WiFi.channel(i));
+    int network = this->networkOf(WiFi.SSID(i));
+    if (network < 0)
+      continue;
+
+    // Find the access point, or a free entry, or else the one we haven't seen for the longest time
+    const uint8_t *bssid = WiFi.BSSID(i);
+    int entry = -1;
+    for (int a = 0; a < WIFI_ACCESS_POINT_CACHE_SIZE && entry < 0; a++)
+      if (this->_accessPoints[a].isUsed && memcmp(this->_accessPoints[a].bssid, bssid, 6) == 0)
+        entry = a;
+    if (entry < 0) {
+      for (int a = 0; a < WIFI_ACCESS_POINT_CACHE_SIZE; a++) {
+        if (!this->_accessPoints[a].isUsed) {
+          entry = a;
+          break;
+        }
+        if (a != this->_accessPoint && (entry < 0 || this->_accessPoints[a].seenTime.isBefore(this->_accessPoints[entry].seenTime)))
+          entry = a;
+      }
+      if (entry < 0)
+        entry = 0;
+      WifiAccessPoint &accessPoint = this->_accessPoints[entry];
+      memcpy(accessPoint.bssid, bssid, 6);
+      accessPoint.failures = 0;
+      accessPoint.connects = 0;
+      accessPoint.isUsed = true;
     }
-    Log::logDebug("[%s] %2d: %s (%d dBm) BSSID %s", this->name(), i + 1, WiFi.SSID(i).c_str(), WiFi.RSSI(i), WiFi.BSSIDstr(i).c_str());
+
+    WifiAccessPoint &accessPoint = this->_accessPoints[entry];
+    accessPoint.network = network;
+    accessPoint.channel = WiFi.channel(i);
+    accessPoint.rssi = WiFi.RSSI(i);
+    accessPoint.seenTime = now;
+    accessPoint.isInLastScan = true;
   }
-  Log::logInformation("[%s] Choosing BSSID '%s'", this->name(), WiFi.BSSIDstr(bestMatch).c_str());
-  bssid = WiFi.BSSID(bestMatch);
-  WiFi.begin(this->_ssid.c_str(), this->_password.c_str(), 0, bssid);
-  return WiFi.BSSIDstr(bestMatch);
+}
+
+// The access point from the last scan or seen recently, of the given network or of the best
+// network that has one, with the best score. -1 if none
+int WifiComponent::bestAccessPoint(bool fromLastScan, int network) {
+  Timestamp now = Clock::millis64();
+  int best = -1;
+  for (int a = 0; a < WIFI_ACCESS_POINT_CACHE_SIZE; a++) {
+    const WifiAccessPoint &accessPoint = this->_accessPoints[a];
+    if (!accessPoint.isUsed || (network >= 0 && accessPoint.network != network))
+      continue;
+    if (fromLastScan ? !accessPoint.isInLastScan : accessPoint.seenTime.elapsed(now) > (long)WIFI_ACCESS_POINT_MAX_AGE_MS)
+      continue;
+    if (best < 0) {
+      best = a;
+      continue;
+    }
+    int32_t networkScore = this->_networks[accessPoint.network].score();
+    int32_t bestNetworkScore = this->_networks[this->_accessPoints[best].network].score();
+    if (networkScore > bestNetworkScore || (networkScore == bestNetworkScore && accessPoint.score() > this->_accessPoints[best].score()))
+      best = a;
+  }
+  return best;
+}
+
+// Connect to a known access point, on its channel
+void WifiComponent::connectTo(int index) {
+  const WifiAccessPoint &accessPoint = this->_accessPoints[index];
+  const WifiNetwork &network = this->_networks[accessPoint.network];
+  Log::logInformation("[%s] Choosing '%s' BSSID '%s' on channel %d (%d dBm, %d failure(s))", this->name(), network.ssid.c_str(), accessPoint.bssidString().c_str(), accessPoint.channel, accessPoint.rssi, accessPoint.failures);
+  this->_accessPoint = index;
+  this->_network = accessPoint.network;
+  this->_connectTime = Clock::millis64();
+  WiFi.begin(network.ssid.c_str(), network.password.c_str(), accessPoint.channel, accessPoint.bssid);
+}
+
+// The index of the network with an SSID, -1 if it's not one of ours
+int WifiComponent::networkOf(const String &ssid) {
+  for (int n = 0; n < this->_networkCount; n++)
+    if (this->_networks[n].ssid == ssid)
+      return n;
+  return -1;
+}
+
+int WifiComponent::networkOfHash(uint32_t hash) {
+  for (int n = 0; n < this->_networkCount; n++)
+    if (ssidHash(this->_networks[n].ssid) == hash)
+      return n;
+  return -1;
+}
+
+// What we learned about connecting to each network, by SSID hash
+struct WifiNetworkRanking {
+  uint32_t ssidHash;
+  uint16_t connects;
+  uint16_t failures;
+  uint32_t connectMs;
+};
+
+// Read the learned ranking of the networks, ignoring networks that are no longer configured
+void WifiComponent::loadRanking() {
+  File file = LittleFS.open(WIFI_RANKING_FILE, "r");
+  if (!file)
+    return;
+  WifiNetworkRanking ranking;
+  while (file.read((uint8_t *)&ranking, sizeof(ranking)) == sizeof(ranking)) {
+    int n = this->networkOfHash(ranking.ssidHash);
+    if (n < 0)
+      continue;
+    this->_networks[n].connects = ranking.connects;
+    this->_networks[n].failures = ranking.failures;
+    this->_networks[n].connectMs = ranking.connectMs;
+    Log::logDebug("[%s] Network '%s': %u connect(s), %u failure(s), %lu ms, score %d", this->name(), this->_networks[n].ssid.c_str(), ranking.connects, ranking.failures, (unsigned long)ranking.connectMs, this->_networks[n].score());
+  }
+  file.close();
+}
+
+// Write the learned ranking. Only done after connecting, so not over and over while there's no WiFi
+void WifiComponent::saveRanking() {
+  if (this->_networkCount < 2)
+    return;
+  File file = LittleFS.open(WIFI_RANKING_FILE, "w");
+  if (!file) {
+    Log::logWarning("[%s] Could not write %s", this->name(), WIFI_RANKING_FILE);
+    return;
+  }
+  for (int n = 0; n < this->_networkCount; n++) {
+    WifiNetworkRanking ranking = { ssidHash(this->_networks[n].ssid), this->_networks[n].connects, this->_networks[n].failures, this->_networks[n].connectMs };
+    file.write((const uint8_t *)&ranking, sizeof(ranking));
+  }
+  file.close();
+}
+
+// The BSSID as a string, e.g. 01:23:45:67:89:AB
+String WifiAccessPoint::bssidString() const {
+  char buffer[18];
+  snprintf(buffer, sizeof(buffer), "%02X:%02X:%02X:%02X:%02X:%02X", this->bssid[0], this->bssid[1], this->bssid[2], this->bssid[3], this->bssid[4], this->bssid[5]);
+  return String(buffer);
 }
@@ -4,19 +4,150 @@
 #include "components.h"
 #include "WiFiClient.h"
 
+// The time to wait after the first failed reconnect attempt. It doubles with every failed
+// attempt, up to the check interval
+#ifndef WIFI_RECONNECT_BACKOFF_MS
+  #define WIFI_RECONNECT_BACKOFF_MS 1000
+#endif
+
+// The number of access points (BSSIDs) of the configured SSID remembered between scans
+#ifndef WIFI_ACCESS_POINT_CACHE_SIZE
+  #define WIFI_ACCESS_POINT_CACHE_SIZE 8
+#endif
+
+// Reconnecting goes straight to the best known access point if it was seen this recently (ms)
+#ifndef WIFI_ACCESS_POINT_MAX_AGE_MS
+  #define WIFI_ACCESS_POINT_MAX_AGE_MS (10 * 60 * 1000UL)
+#endif
+
+// How long to wait for a connection to a known access point before scanning (ms)
+#ifndef WIFI_KNOWN_ACCESS_POINT_TIMEOUT_MS
+  #define WIFI_KNOWN_ACCESS_POINT_TIMEOUT_MS 5000
+#endif
+
+// Roaming: scan for a better access point at most this often (ms), and give up on a scan after this long (ms)
+#ifndef WIFI_ROAM_SCAN_INTERVAL_MS
+  #define WIFI_ROAM_SCAN_INTERVAL_MS 60000
+#endif
+#ifndef WIFI_ROAM_SCAN_TIMEOUT_MS
+  #define WIFI_ROAM_SCAN_TIMEOUT_MS 5000
+#endif
+
+// The number of networks (SSIDs) that can be configured, and the file their learned ranking is kept in
+#ifndef WIFI_MAX_NETWORKS
+  #define WIFI_MAX_NETWORKS 4
+#endif
+#ifndef WIFI_RANKING_FILE
+  #define WIFI_RANKING_FILE "/wifi.rank"
+#endif
+
+// Where the last good connection is kept: in RTC memory across restarts (ESP8266: the
+// offset in 4-byte blocks of the user memory) and in a LittleFS file across power cycles
+#ifndef WIFI_CACHE_RTC_OFFSET
+  #define WIFI_CACHE_RTC_OFFSET 32
+#endif
+#ifndef WIFI_CACHE_FILE
+  #define WIFI_CACHE_FILE "/wifi.cache"
+#endif
+
+/***
+ * The last good connection: the access point, its channel and the IP configuration
+ */
+struct WifiConnectionCache {
+  uint32_t magic;
+  // Of everything below, so garbage in RTC memory after a power cycle is not used
+  uint32_t checksum;
+  // Of the SSID, so the cache is ignored after configuring another one
+  uint32_t ssidHash;
+  uint8_t bssid[6];
+  uint8_t padding[2];
+  int32_t channel;
+  int32_t rssi;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+/***
+ * A configured network, and what we learned about connecting to it
+ */
+struct WifiNetwork {
+  String ssid;
+  String password;
+  // Successful connections and failed attempts (both halved now and then, so the recent ones
+  // count most), and the average time it took to connect (ms)
+  uint16_t connects;
+  uint16_t failures;
+  uint32_t connectMs;
+
+  // The higher the better: the percentage of attempts that succeeded (50 if there were none yet),
+  // minus 1 for every 250 ms it takes to connect
+  int32_t score() const { return (int32_t)((this->connects + 1) * 100UL / (this->connects + this->failures + 2UL)) - (int32_t)(this->connectMs / 250); }
+  void learn(bool success, uint32_t ms);
+};
+
+/***
+ * An access point (BSSID) of a configured network, as seen by a scan
+ */
+struct WifiAccessPoint {
+  bool isUsed;
+  // The index of its network
+  uint8_t network;
+  uint8_t bssid[6];
+  int32_t channel;
+  int32_t rssi;
+  // When the access point was last seen, and whether the latest scan saw it
+  Deadline seenTime;
+  bool isInLastScan;
+  // Connection attempts that failed since the last one that succeeded, and successful connections
+  uint8_t failures;
+  unsigned long connects;
+
+  // The higher the better: the signal strength, minus 10 dB for every recent failure to connect
+  int32_t score() const { return this->rssi - 10 * (int32_t)this->failures; }
+  String bssidString() const;
+};
+
+/***
+ * Where the station (client) connection of the WiFi component is at
+ */
+enum WifiState {
+  // No station WiFi configured
+  WifiOff,
+  // Scanning for the strongest access point
+  WifiScanning,
+  // Waiting for the connection to the chosen access point
+  WifiConnecting,
+  // Connected, checked every [interval] ms
+  WifiConnected,
+  // Connecting at boot failed; we may have a soft AP. Retried every [interval] ms
+  WifiFailed,
+  // Reconnecting failed; waiting before the next attempt
+  WifiBackoff,
+  // Connected, scanning for a stronger access point in the background
+  WifiRoaming
+};
+#define WIFI_STATE_COUNT (WifiRoaming + 1)
+
 /***
  * A Wifi component that connects to a WiFi network and optionally reconnects
  * periodically if the connection is lost
+ *
+ * Connecting and reconnecting are done from loop(), so they don't hold up the other components.
+ * The component is ready when connected
 */
 class WifiComponent: public Component {
   private:
     String _hostname;
-    String _ssid;
-    String _password;
+    // The configured networks, and the one we're connecting/connected to (-1 if none yet)
+    WifiNetwork _networks[WIFI_MAX_NETWORKS];
+    int _networkCount;
+    int _network;
     unsigned long _intervalMs;
     uint32_t _waitMs;
 
-    unsigned long _lastCheckTime;
+    Deadline _lastCheckTime;
     static WiFiClient _wifiClient;
 
     uint16_t _watchdogTimeoutSeconds;
@@ -24,8 +155,83 @@ class WifiComponent: public Component {
     String _ap_ssid;
     String _ap_password;
     bool _fallbackOnly;
+    bool _haveSoftAP;
+
+    WifiState _state;
+    // When the current state was entered (in Clock::millis64(), like all times here), and the time spent in each state before (ms)
+    Timestamp _stateTime;
+    uint64_t _stateMs[WIFI_STATE_COUNT];
+
+    // Reconnecting after losing the connection: since when, how long until the next attempt and the attempts so far
+    bool _isReconnecting;
+    Timestamp _disconnectTime;
+    unsigned long _backoffMs;
+    unsigned long _attempts;
+    // Reconnect statistics
+    unsigned long _totalAttempts;
+    unsigned long _failedAttempts;
+    unsigned long _reconnects;
+    unsigned long _lastReconnectMs;
+    unsigned long _maxReconnectMs;
+
+    // When setup() was called, and when the current connection attempt started
+    Timestamp _setupTime;
+    Timestamp _connectTime;
+
+    // Access points of the configured networks seen by scans, and the one we're connecting/connected to (-1 if unknown)
+    WifiAccessPoint _accessPoints[WIFI_ACCESS_POINT_CACHE_SIZE];
+    int _accessPoint;
+    // Are we trying the best known access point, without scanning first?
+    bool _isKnownAccessPointAttempt;
+
+    // Boot: connect directly with the last good connection, optionally reusing its IP configuration
+    bool _fastConnect;
+    bool _reuseIpAddress;
+    WifiConnectionCache _cache;
+    bool _haveCache;
+    bool _isUsingCachedIp;
+    // The time from boot until we had an IP address (0 if not yet), and whether it was a direct connect
+    unsigned long _bootToIpMs;
+    bool _wasFastConnect;
+
+    // Roaming: scan when the average RSSI, sampled every [interval] ms, is below the threshold (0 if off),
+    // and switch when another access point is at least [hysteresis] dB stronger
+    int32_t _roamThreshold;
+    int32_t _roamHysteresis;
+    unsigned long _roamSampleMs;
+    Deadline _nextRoamSampleTime;
+    Timestamp _lastRoamScanTime;
+    int32_t _averageRssi;
+    bool _isRoaming;
+    // Roam statistics
+    unsigned long _roamScans;
+    unsigned long _roams;
+    unsigned long _lastRoamMs;
 
     bool setupSoftAP();
+    void startScan();
+    void checkScan();
+    void checkConnecting();
+    void connected();
+    void startReconnect();
+    void startAttempt();
+    void attemptFailed(const char *reason);
+    String connectToBest(int networkCount);
+    void updateAccessPoints(int networkCount);
+    int bestAccessPoint(bool fromLastScan, int network = -1);
+    int networkOf(const String &ssid);
+    int networkOfHash(uint32_t ssidHash);
+    void loadRanking();
+    void saveRanking();
+    void connectTo(int accessPoint);
+    void sampleRssi();
+    void checkRoamScan();
+    void connectToCached();
+    void useDhcp();
+    bool loadConnectionCache();
+    void saveConnectionCache();
+    void fallBack(const char *reason);
+    void setState(WifiState state);
     
   public:
     WifiComponent(
@@ -37,13 +243,56 @@ class WifiComponent: public Component {
       bool fallbackOnly = true // If true, the soft-AP is only used when no connection is posssible with the "normal" ssid (or none is present)
     );
 
+    // Call before setup(): at boot, connect directly to the access point of the last good connection
+    // (on by default), and reuse its IP address instead of waiting for DHCP (off by default)
+    void setFastConnect(bool fastConnect, bool reuseIpAddress = false) { this->_fastConnect = fastConnect; this->_reuseIpAddress = reuseIpAddress; }
+
+    // Roam to an access point at least [hysteresisDb] stronger when the average RSSI, sampled every
+    // [sampleIntervalMs], drops below [thresholdDbm]. A threshold of 0 turns roaming off (the default)
+    void setRoaming(int32_t thresholdDbm, int32_t hysteresisDb = 8, unsigned long sampleIntervalMs = 10000) { this->_roamThreshold = thresholdDbm; this->_roamHysteresis = hysteresisDb; this->_roamSampleMs = sampleIntervalMs; }
+
+    // Call before setup() to add a network (SSID) to connect to. The one passed to the constructor is
+    // the first. Networks are tried in the order of their WifiNetwork::score(), learned by connecting
+    bool addNetwork(const char *ssid, const char *password);
+    int networkCount() { return this->_networkCount; }
+    const WifiNetwork *networks() { return this->_networks; }
+    // The network we're connecting/connected to, NULL if none yet
+    const WifiNetwork *network() { return this->_network < 0 ? NULL : &this->_networks[this->_network]; }
+
     WiFiClient *wifiClient() { return &this->_wifiClient; }
+    WifiState state() { return this->_state; }
+
+    // The number of times the connection was restored, the reconnect attempts and the ones that
+    // failed, and how long restoring the connection took (last and maximum, ms)
+    unsigned long reconnects() { return this->_reconnects; }
+    unsigned long reconnectAttempts() { return this->_totalAttempts; }
+    unsigned long failedReconnectAttempts() { return this->_failedAttempts; }
+    unsigned long lastReconnectMs() { return this->_lastReconnectMs; }
+    unsigned long maxReconnectMs() { return this->_maxReconnectMs; }
+    // The time from boot until we had an IP address (ms, 0 if not yet), and whether the last good
+    // connection was used to get it
+    unsigned long bootToIpMs() { return this->_bootToIpMs; }
+    bool wasFastConnect() { return this->_wasFastConnect; }
+    // The number of roaming scans and switches to a stronger access point, and how long the last switch took (ms)
+    unsigned long roamScans() { return this->_roamScans; }
+    unsigned long roams() { return this->_roams; }
+    unsigned long lastRoamMs() { return this->_lastRoamMs; }
+    // All of the above as "key=value;" pairs
+    String statistics();
+    // The time spent in each state, as "state=seconds;" pairs
+    String stateTimes();
+
+    // The access points of the networks seen so far, ranked by their network's score and then by
+    // WifiAccessPoint::score() when connecting
+    const WifiAccessPoint *accessPoints() { return this->_accessPoints; }
+    // The access point we're connected to, NULL if not known
+    const WifiAccessPoint *accessPoint() { return this->_accessPoint < 0 ? NULL : &this->_accessPoints[this->_accessPoint]; }
 
     // Required by Component
     void setup();
     void loop();
 
-    // Scan WiFi networks for the configured SSID and connect to the strongest BSSID
+    // Scan WiFi networks for the configured SSIDs and connect to the best BSSID (blocking)
     String connectToStrongest(); // --> BSSID
 };
 